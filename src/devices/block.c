@@ -3,7 +3,60 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Requests are queued on the device that services them: a
+   partition's requests go to the queue of the device that holds
+   it.  An I/O thread takes the requests from the busy devices in
+   turn and hands them to the drivers.  Each queue is kept in sector
+   order and served in C-SCAN order, ascending from the last
+   sector transferred and then starting over at the lowest, which
+   keeps seeks short.  Requests have priority classes, and a device
+   serves its most urgent class first; among the busy devices on a
+   channel, the one with the most urgent request goes first.  A
+   request whose deadline has passed is served ahead of all
+   others, on its channel as well as on its device, so that no
+   request, even an idle one, waits indefinitely: the deadline is
+   shorter the more urgent the class.  A queued request is raised
+   to a more urgent class with block_boost() when a more urgent
+   thread comes to wait for it.  A request is merged with those
+   that continue it on the disk in the same direction into a
+   single transfer, and a driver that can keep several transfers
+   outstanding is given up to MAX_BATCHES of them at a time.
+
+   Each device belongs to a channel, the unit of hardware that
+   can carry out one transfer at a time, such as an IDE channel
+   shared by a master and a slave disk.  Every channel has its own
+   I/O thread that serves the busy devices on it in turn, so
+   transfers on different channels proceed at the same time: swap
+   traffic on one IDE channel does not wait for file system
+   traffic on the other.
+
+   Every device keeps statistics on its completed requests: how
+   many there were and how many bytes they moved for each purpose,
+   and histograms of how long they waited in the queue and how
+   long the driver took to carry them out.  A partition's requests
+   count toward both the partition and the device holding it. */
+
+/* A channel, with the thread that serves its devices. */
+struct block_channel
+  {
+    struct list_elem elem;              /* Element in all_channels. */
+    char name[16];                      /* Name, also of its thread. */
+
+    struct lock lock;                   /* Protects the members below and
+                                           its devices' queues. */
+    struct condition cond;              /* Signaled when a device is busy. */
+    struct list busy_devices;           /* Devices with queued requests. */
+
+    /* Statistics, owned by the channel's thread. */
+    unsigned long long batch_cnt;       /* Transfers carried out. */
+    unsigned long long sector_cnt;      /* Sectors transferred. */
+    int64_t busy_ticks;                 /* Ticks spent with requests. */
+  };
 
 /* A block device. */
 struct block
@@ -17,18 +70,88 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
+    struct block *parent;               /* Device holding a partition. */
+    block_sector_t start;               /* Partition's first sector there. */
+
+    /* Request queue, for a device that is not a partition.
+       Protected by CHANNEL's lock. */
+    struct block_channel *channel;      /* Channel serving the device. */
+    struct list queue;                  /* Pending requests, by sector. */
+    block_sector_t head;                /* Sector past the last transfer. */
+    size_t class_cnt[IO_CLASS_CNT];     /* Queued requests in each class. */
+    bool busy;                          /* In busy_devices? */
+    struct list_elem busy_elem;         /* Element in busy_devices. */
+
+    /* Statistics, protected by CHANNEL's lock. */
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    struct iostat stats;                /* Requests, bytes and latencies. */
   };
 
+/* Ticks a read or a write in each class may wait before it is
+   served ahead of the elevator and class order. */
+static const int64_t read_deadline[IO_CLASS_CNT] =
+  { TIMER_FREQ / 20, TIMER_FREQ / 2, TIMER_FREQ, TIMER_FREQ * 2 };
+static const int64_t write_deadline[IO_CLASS_CNT] =
+  { TIMER_FREQ / 10, TIMER_FREQ * 5, TIMER_FREQ * 5, TIMER_FREQ * 10 };
+
+/* Most sectors merged into one transfer. */
+#define MAX_MERGE 64
+
+/* Most transfers given at once to a driver that can have several
+   outstanding. */
+#define MAX_BATCHES 8
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
+/* List of all channels. */
+static struct list all_channels = LIST_INITIALIZER (all_channels);
+
+/* Number of channels with requests, and the ticks spent with more
+   than one of them busy. */
+static int busy_channel_cnt;
+static int64_t overlap_start;
+static int64_t overlap_ticks;
+static struct lock overlap_lock;        /* Protects the above. */
+
+static thread_func io_thread NO_RETURN;
+
 /* The block block assigned to each Pintos role. */
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
 
+/* Initializes the block layer.  Must be called before any
+   channel is created or block device registered. */
+void
+block_init (void)
+{
+  lock_init (&overlap_lock);
+}
+
+/* Creates a channel named NAME and starts its I/O thread.  Devices
+   registered on the channel have their requests carried out one
+   at a time, by that thread. */
+struct block_channel *
+block_channel_create (const char *name)
+{
+  struct block_channel *ch = malloc (sizeof *ch);
+  if (ch == NULL)
+    PANIC ("Failed to allocate memory for block channel");
+
+  list_push_back (&all_channels, &ch->elem);
+  strlcpy (ch->name, name, sizeof ch->name);
+  lock_init (&ch->lock);
+  cond_init (&ch->cond);
+  list_init (&ch->busy_devices);
+  ch->batch_cnt = 0;
+  ch->sector_cnt = 0;
+  ch->busy_ticks = 0;
+  thread_create (ch->name, PRI_MAX, io_thread, ch);
+  return ch;
+}
+
 /* Returns a human-readable name for the given block device
    TYPE. */
 const char *
@@ -113,6 +236,117 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Verifies that CNT sectors starting at SECTOR lie within BLOCK.
+   Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (sector + cnt - 1 >= sector);
+}
+
+/* Queues request R, for R->CNT sectors starting at R->SECTOR of
+   BLOCK, and returns without waiting for it.  When the transfer
+   is done, R->DONE is called with R from the block layer's
+   thread, so it must not block on I/O itself.  R must remain
+   valid until then. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  struct block *dev = block->parent != NULL ? block->parent : block;
+  struct block_channel *ch = dev->channel;
+  struct list_elem *e;
+
+  check_sectors (block, r->sector, r->cnt);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+  ASSERT (r->done != NULL);
+  ASSERT (r->class < IO_CLASS_CNT);
+
+  r->block = block;
+  r->dev_sector = r->sector + block->start;
+  r->deadline = timer_ticks () + (r->write ? write_deadline[r->class]
+                                           : read_deadline[r->class]);
+  r->submit_usecs = timer_usecs ();
+  r->queued = true;
+
+  /* Keep the queue in sector order for the elevator. */
+  lock_acquire (&ch->lock);
+  for (e = list_begin (&dev->queue); e != list_end (&dev->queue);
+       e = list_next (e))
+    if (list_entry (e, struct block_request, elem)->dev_sector
+        > r->dev_sector)
+      break;
+  list_insert (e, &r->elem);
+  dev->class_cnt[r->class]++;
+  if (!dev->busy)
+    {
+      dev->busy = true;
+      list_push_back (&ch->busy_devices, &dev->busy_elem);
+      cond_signal (&ch->cond, &ch->lock);
+    }
+  lock_release (&ch->lock);
+}
+
+/* Raises request R to CLASS, if that is more urgent than R's own
+   class, and brings R's deadline forward to match, because a
+   thread in CLASS has come to depend on R.  Does nothing if R has
+   already been handed to the driver.  The caller must make sure
+   that R remains valid, that is, that R's DONE function has not
+   yet returned control to R's owner. */
+void
+block_boost (struct block_request *r, enum io_class class)
+{
+  struct block *dev = r->block->parent != NULL ? r->block->parent : r->block;
+  struct block_channel *ch = dev->channel;
+
+  ASSERT (class < IO_CLASS_CNT);
+
+  lock_acquire (&ch->lock);
+  if (r->queued && class < r->class)
+    {
+      int64_t deadline = timer_ticks () + (r->write ? write_deadline[class]
+                                                    : read_deadline[class]);
+      dev->class_cnt[r->class]--;
+      dev->class_cnt[class]++;
+      r->class = class;
+      if (deadline < r->deadline)
+        r->deadline = deadline;
+    }
+  lock_release (&ch->lock);
+}
+
+/* Completion function for the requests of sync_request(). */
+static void
+wake_waiter (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Transfers CNT sectors starting at SECTOR between BLOCK and
+   BUFFER, writing if WRITE is true, and waits for the transfer
+   to finish. */
+static void
+sync_request (struct block *block, block_sector_t sector, size_t cnt,
+              void *buffer, bool write)
+{
+  struct block_request r;
+  struct semaphore done;
+
+  sema_init (&done, 0);
+  r.sector = sector;
+  r.cnt = cnt;
+  r.buffer = buffer;
+  r.write = write;
+  r.purpose = thread_current ()->io_purpose;
+  r.class = thread_current ()->io_class;
+  r.done = wake_waiter;
+  r.aux = &done;
+  block_submit (block, &r);
+  sema_down (&done);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -120,9 +354,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  sync_request (block, sector, 1, buffer, false);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +365,466 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  sync_request (block, sector, 1, (void *) buffer, true);
+}
+
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Uses a single device command if the driver supports
+   it.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     size_t cnt, void *buffer)
+{
+  sync_request (block, sector, cnt, buffer, false);
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Uses a single device command if the driver supports it.
+   Returns after the block device has acknowledged receiving the
+   data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      size_t cnt, const void *buffer)
+{
+  sync_request (block, sector, cnt, (void *) buffer, true);
+}
+
+/* Sets the purpose recorded for the requests that the running
+   thread makes through block_read() and the other synchronous
+   functions to PURPOSE, and returns the previous purpose, so that
+   the caller can restore it when done. */
+enum io_purpose
+block_set_purpose (enum io_purpose purpose)
+{
+  struct thread *t = thread_current ();
+  enum io_purpose old = t->io_purpose;
+
+  ASSERT (purpose < IO_PURPOSE_CNT);
+  t->io_purpose = purpose;
+  return old;
+}
+
+/* Sets the priority class of the requests that the running
+   thread makes through block_read() and the other synchronous
+   functions to CLASS, and returns the previous class, so that the
+   caller can restore it when done. */
+enum io_class
+block_set_class (enum io_class class)
+{
+  struct thread *t = thread_current ();
+  enum io_class old = t->io_class;
+
+  ASSERT (class < IO_CLASS_CNT);
+  t->io_class = class;
+  return old;
+}
+
+/* Request scheduling. */
+
+/* Returns the most urgent class with requests in DEV's queue,
+   which must not be empty. */
+static enum io_class
+best_class (const struct block *dev)
+{
+  enum io_class class = 0;
+
+  while (dev->class_cnt[class] == 0)
+    {
+      class++;
+      ASSERT (class < IO_CLASS_CNT);
+    }
+  return class;
+}
+
+/* Chooses the next request to dispatch from DEV's queue, which
+   must not be empty: the request whose deadline passed longest
+   ago, if any has, or else the next request of the most urgent
+   class in C-SCAN order, that is, the first at or past DEV's
+   head position, wrapping around to the lowest sector. */
+static struct block_request *
+choose_request (struct block *dev)
+{
+  struct block_request *oldest = NULL, *next = NULL, *lowest = NULL;
+  enum io_class class = best_class (dev);
+  struct list_elem *e;
+
+  for (e = list_begin (&dev->queue); e != list_end (&dev->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (oldest == NULL || r->deadline < oldest->deadline)
+        oldest = r;
+      if (r->class != class)
+        continue;
+      if (lowest == NULL)
+        lowest = r;
+      if (next == NULL && r->dev_sector >= dev->head)
+        next = r;
+    }
+
+  if (oldest->deadline <= timer_ticks ())
+    return oldest;
+  return next != NULL ? next : lowest;
+}
+
+/* Returns the earliest deadline of the requests in DEV's queue,
+   which must not be empty. */
+static int64_t
+earliest_deadline (struct block *dev)
+{
+  int64_t deadline = INT64_MAX;
+  struct list_elem *e;
+
+  for (e = list_begin (&dev->queue); e != list_end (&dev->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->deadline < deadline)
+        deadline = r->deadline;
+    }
+  return deadline;
+}
+
+/* Removes and returns the device on channel CH to serve next:
+   the one whose deadline passed longest ago, if any device has a
+   request past its deadline, so that a steady stream of urgent
+   requests to one device does not starve another on the same
+   channel, or else the one with the most urgent request, the
+   first in CH's list of busy devices if there is a tie.  CH must
+   have a busy device. */
+static struct block *
+choose_device (struct block_channel *ch)
+{
+  struct block *best = NULL, *late = NULL;
+  int64_t now = timer_ticks ();
+  int64_t late_deadline = now;
+  struct list_elem *e;
+
+  for (e = list_begin (&ch->busy_devices); e != list_end (&ch->busy_devices);
+       e = list_next (e))
+    {
+      struct block *dev = list_entry (e, struct block, busy_elem);
+      int64_t deadline = earliest_deadline (dev);
+
+      if (deadline <= late_deadline)
+        {
+          late = dev;
+          late_deadline = deadline;
+        }
+      if (best == NULL || best_class (dev) < best_class (best))
+        best = dev;
+    }
+  if (late != NULL)
+    best = late;
+  list_remove (&best->busy_elem);
+  return best;
+}
+
+/* A group of requests that continue each other on a device and
+   are carried out as a single transfer. */
+struct batch
+  {
+    struct list requests;               /* Requests, in sector order. */
+    block_sector_t sector;              /* First sector on the device. */
+    size_t cnt;                         /* Number of sectors. */
+    bool write;                         /* Write if true, else read. */
+    uint8_t *buffer;                    /* Buffer for the whole batch, or
+                                           null to go request by request. */
+    uint8_t *bounce;                    /* Bounce buffer to free, or null. */
+  };
+
+/* Removes the next request from DEV's queue, together with the
+   requests in the same direction that continue it on the disk,
+   up to MAX_MERGE sectors in all, and puts them in B. */
+static void
+take_batch (struct block *dev, struct batch *b)
+{
+  struct block_request *r = choose_request (dev);
+
+  list_init (&b->requests);
+  b->sector = r->dev_sector;
+  b->cnt = 0;
+  b->write = r->write;
+  for (;;)
+    {
+      struct list_elem *next = list_next (&r->elem);
+
+      list_remove (&r->elem);
+      list_push_back (&b->requests, &r->elem);
+      dev->class_cnt[r->class]--;
+      r->queued = false;
+      b->cnt += r->cnt;
+      if (next == list_end (&dev->queue))
+        break;
+
+      r = list_entry (next, struct block_request, elem);
+      if (r->write != b->write || r->dev_sector != b->sector + b->cnt
+          || b->cnt + r->cnt > MAX_MERGE)
+        break;
+    }
+  dev->head = b->sector + b->cnt;
+}
+
+/* Chooses the buffer for batch B: the requests' own buffer if
+   there is one request or their buffers are adjacent in memory,
+   or else a bounce buffer, filled from the requests for a write.
+   Leaves B->BUFFER null if a bounce buffer cannot be
+   allocated. */
+static void
+prepare_batch (struct batch *b)
+{
+  struct block_request *first = list_entry (list_front (&b->requests),
+                                            struct block_request, elem);
+  uint8_t *contiguous = first->buffer;
+  struct list_elem *e;
+
+  b->buffer = first->buffer;
+  b->bounce = NULL;
+  for (e = list_begin (&b->requests); e != list_end (&b->requests);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->buffer != contiguous)
+        break;
+      contiguous += r->cnt * BLOCK_SECTOR_SIZE;
+    }
+  if (e == list_end (&b->requests))
+    return;
+
+  b->buffer = b->bounce = malloc (b->cnt * BLOCK_SECTOR_SIZE);
+  if (b->bounce != NULL && b->write)
+    {
+      size_t ofs = 0;
+
+      for (e = list_begin (&b->requests); e != list_end (&b->requests);
+           e = list_next (e))
+        {
+          struct block_request *r = list_entry (e, struct block_request,
+                                                elem);
+          memcpy (b->bounce + ofs, r->buffer, r->cnt * BLOCK_SECTOR_SIZE);
+          ofs += r->cnt * BLOCK_SECTOR_SIZE;
+        }
+    }
+}
+
+/* Transfers CNT sectors starting at SECTOR between DEV and
+   BUFFER through DEV's driver, writing if WRITE is true. */
+static void
+transfer (struct block *dev, block_sector_t sector, size_t cnt,
+          uint8_t *buffer, bool write)
+{
+  size_t i;
+
+  if (write && dev->ops->write_multiple != NULL)
+    dev->ops->write_multiple (dev->aux, sector, cnt, buffer);
+  else if (!write && dev->ops->read_multiple != NULL)
+    dev->ops->read_multiple (dev->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      {
+        uint8_t *sector_buffer = buffer + i * BLOCK_SECTOR_SIZE;
+        if (write)
+          dev->ops->write (dev->aux, sector + i, sector_buffer);
+        else
+          dev->ops->read (dev->aux, sector + i, sector_buffer);
+      }
+}
+
+/* Carries out the CNT batches in BATCHES on DEV.  A driver that
+   can have several transfers outstanding is given all of them at
+   once. */
+static void
+transfer_batches (struct block *dev, struct batch *batches, size_t cnt)
+{
+  struct block_transfer xfers[MAX_BATCHES];
+  size_t xfer_cnt = 0;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      struct batch *b = &batches[i];
+
+      if (b->buffer == NULL)
+        {
+          /* No single buffer: one transfer per request. */
+          struct list_elem *e;
+
+          for (e = list_begin (&b->requests); e != list_end (&b->requests);
+               e = list_next (e))
+            {
+              struct block_request *r = list_entry (e, struct block_request,
+                                                    elem);
+              transfer (dev, r->dev_sector, r->cnt, r->buffer, r->write);
+            }
+        }
+      else if (dev->ops->transfer_many != NULL)
+        {
+          struct block_transfer *x = &xfers[xfer_cnt++];
+          x->sector = b->sector;
+          x->cnt = b->cnt;
+          x->buffer = b->buffer;
+          x->write = b->write;
+        }
+      else
+        transfer (dev, b->sector, b->cnt, b->buffer, b->write);
+    }
+  if (xfer_cnt > 0)
+    dev->ops->transfer_many (dev->aux, xfers, xfer_cnt);
+}
+
+/* Counts a latency of USECS microseconds in histogram HIST. */
+static void
+record_latency (unsigned long long hist[IO_HIST_BUCKETS], int64_t usecs)
+{
+  int bucket = 0;
+
+  while (usecs > 0 && bucket < IO_HIST_BUCKETS - 1)
+    {
+      usecs >>= 1;
+      bucket++;
+    }
+  hist[bucket]++;
+}
+
+/* Accounts for request R, which was handed to the driver at
+   DISPATCH and completed at DONE, both in microseconds, in
+   BLOCK's statistics. */
+static void
+account (struct block *block, const struct block_request *r,
+         int64_t dispatch, int64_t done)
+{
+  struct iostat *s = &block->stats;
+
+  if (r->write)
+    block->write_cnt += r->cnt;
+  else
+    block->read_cnt += r->cnt;
+  s->requests[r->purpose]++;
+  s->bytes[r->purpose] += r->cnt * BLOCK_SECTOR_SIZE;
+  record_latency (s->wait, dispatch - r->submit_usecs);
+  record_latency (s->service, done - dispatch);
+}
+
+/* Copies the data of read batch B out of its bounce buffer, if
+   it has one, then accounts for and completes B's requests.  B
+   was handed to the driver at DISPATCH and completed at DONE, in
+   microseconds. */
+static void
+finish_batch (struct block *dev, struct batch *b, int64_t dispatch,
+              int64_t done)
+{
+  struct list_elem *e;
+  size_t ofs = 0;
+
+  if (b->bounce != NULL)
+    {
+      if (!b->write)
+        for (e = list_begin (&b->requests); e != list_end (&b->requests);
+             e = list_next (e))
+          {
+            struct block_request *r = list_entry (e, struct block_request,
+                                                  elem);
+            memcpy (r->buffer, b->bounce + ofs, r->cnt * BLOCK_SECTOR_SIZE);
+            ofs += r->cnt * BLOCK_SECTOR_SIZE;
+          }
+      free (b->bounce);
+    }
+
+  lock_acquire (&dev->channel->lock);
+  for (e = list_begin (&b->requests); e != list_end (&b->requests);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      account (r->block, r, dispatch, done);
+      if (r->block != dev)
+        account (dev, r, dispatch, done);
+    }
+  lock_release (&dev->channel->lock);
+
+  /* A request's DONE function may free it, so advance past it
+     first. */
+  for (e = list_begin (&b->requests); e != list_end (&b->requests); )
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      e = list_next (e);
+      r->done (r);
+    }
+}
+
+/* Records that a channel became busy, if BUSY is true, or idle,
+   keeping track of the time more than one channel is busy. */
+static void
+note_busy (bool busy)
+{
+  lock_acquire (&overlap_lock);
+  if (busy && ++busy_channel_cnt == 2)
+    overlap_start = timer_ticks ();
+  else if (!busy && busy_channel_cnt-- == 2)
+    overlap_ticks += timer_ticks () - overlap_start;
+  lock_release (&overlap_lock);
+}
+
+/* Services the request queues of the devices on channel CH_,
+   taking a batch from each busy device in turn. */
+static void
+io_thread (void *ch_)
+{
+  struct block_channel *ch = ch_;
+  int64_t busy_start = 0;
+  bool busy = false;
+
+  for (;;)
+    {
+      struct batch batches[MAX_BATCHES];
+      struct block *dev;
+      int64_t dispatch, done;
+      size_t cnt, i;
+
+      lock_acquire (&ch->lock);
+      if (busy && list_empty (&ch->busy_devices))
+        {
+          busy = false;
+          ch->busy_ticks += timer_ticks () - busy_start;
+          note_busy (false);
+        }
+      while (list_empty (&ch->busy_devices))
+        cond_wait (&ch->cond, &ch->lock);
+      if (!busy)
+        {
+          busy = true;
+          busy_start = timer_ticks ();
+          note_busy (true);
+        }
+      dev = choose_device (ch);
+      cnt = 0;
+      do
+        take_batch (dev, &batches[cnt++]);
+      while (dev->ops->transfer_many != NULL && cnt < MAX_BATCHES
+             && !list_empty (&dev->queue));
+      if (!list_empty (&dev->queue))
+        list_push_back (&ch->busy_devices, &dev->busy_elem);
+      else
+        dev->busy = false;
+      lock_release (&ch->lock);
+
+      for (i = 0; i < cnt; i++)
+        prepare_batch (&batches[i]);
+      dispatch = timer_usecs ();
+      transfer_batches (dev, batches, cnt);
+      done = timer_usecs ();
+      for (i = 0; i < cnt; i++)
+        {
+          ch->batch_cnt++;
+          ch->sector_cnt += batches[i].cnt;
+          finish_batch (dev, &batches[i], dispatch, done);
+        }
+    }
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,33 +848,96 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Stores a copy of BLOCK's statistics in *STATS. */
+void
+block_get_stats (struct block *block, struct iostat *stats)
+{
+  lock_acquire (&block->channel->lock);
+  *stats = block->stats;
+  lock_release (&block->channel->lock);
+}
+
+/* Prints latency histogram HIST, labeled LABEL, leaving out empty
+   buckets. */
+static void
+print_histogram (const char *label, const unsigned long long *hist)
+{
+  int i;
+
+  printf ("  %s (us):", label);
+  for (i = 0; i < IO_HIST_BUCKETS - 1; i++)
+    if (hist[i] > 0)
+      printf (" <%llu:%llu", 1ULL << i, hist[i]);
+  if (hist[i] > 0)
+    printf (" >=%llu:%llu", 1ULL << (i - 1), hist[i]);
+  printf ("\n");
+}
+
+/* Prints the statistics of BLOCK, which is used for a Pintos
+   role. */
+static void
+print_block_stats (struct block *block)
+{
+  static const char *purpose_names[IO_PURPOSE_CNT] =
+    {
+      "file data",
+      "metadata",
+      "swap-in",
+      "swap-out",
+      "mmap write-back",
+      "other",
+    };
+  struct iostat s;
+  int i;
+
+  block_get_stats (block, &s);
+  printf ("%s (%s): %llu reads, %llu writes\n",
+          block->name, block_type_name (block->type),
+          block->read_cnt, block->write_cnt);
+  for (i = 0; i < IO_PURPOSE_CNT; i++)
+    if (s.requests[i] > 0)
+      printf ("  %s: %llu requests, %llu bytes\n",
+              purpose_names[i], s.requests[i], s.bytes[i]);
+  print_histogram ("queue wait", s.wait);
+  print_histogram ("service", s.service);
+}
+
+/* Prints statistics for each block device used for a Pintos role
+   and for each channel that did any work. */
 void
 block_print_stats (void)
 {
+  struct list_elem *e;
   int i;
 
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
+    if (block_by_role[i] != NULL)
+      print_block_stats (block_by_role[i]);
+
+  for (e = list_begin (&all_channels); e != list_end (&all_channels);
+       e = list_next (e))
     {
-      struct block *block = block_by_role[i];
-      if (block != NULL)
-        {
-          printf ("%s (%s): %llu reads, %llu writes\n",
-                  block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
-        }
+      struct block_channel *ch = list_entry (e, struct block_channel, elem);
+      if (ch->batch_cnt > 0)
+        printf ("%s: %llu transfers, %llu sectors, %"PRId64" ticks busy\n",
+                ch->name, ch->batch_cnt, ch->sector_cnt, ch->busy_ticks);
     }
+  printf ("Block channels: %"PRId64" ticks with more than one busy\n",
+          overlap_ticks);
 }
 
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
    be provided, as well as the it operation functions OPS, which
-   will be passed AUX in each function call. */
+   will be passed AUX in each function call.  The device's
+   requests are carried out on CHANNEL, or on a new channel of its
+   own if CHANNEL is null. */
 struct block *
 block_register (const char *name, enum block_type type,
                 const char *extra_info, block_sector_t size,
-                const struct block_operations *ops, void *aux)
+                const struct block_operations *ops, void *aux,
+                struct block_channel *channel)
 {
   struct block *block = malloc (sizeof *block);
   if (block == NULL)
@@ -198,8 +949,16 @@ block_register (const char *name, enum block_type type,
   block->size = size;
   block->ops = ops;
   block->aux = aux;
+  block->parent = NULL;
+  block->start = 0;
+  block->channel = channel != NULL ? channel : block_channel_create (name);
+  list_init (&block->queue);
+  block->head = 0;
+  memset (block->class_cnt, 0, sizeof block->class_cnt);
+  block->busy = false;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  memset (&block->stats, 0, sizeof block->stats);
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -211,6 +970,25 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Registers a partition of PARENT named NAME, of the given TYPE,
+   that consists of SIZE sectors starting at sector START of
+   PARENT, as block_register() does.  Requests to the partition
+   are carried out by PARENT's driver. */
+struct block *
+block_register_partition (const char *name, enum block_type type,
+                          const char *extra_info, struct block *parent,
+                          block_sector_t start, block_sector_t size)
+{
+  struct block *block;
+
+  ASSERT (parent->parent == NULL);
+  block = block_register (name, type, extra_info, size, parent->ops,
+                          parent->aux, parent->channel);
+  block->parent = parent;
+  block->start = start;
+  return block;
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
@@ -1,8 +1,11 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <iostat.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -41,6 +44,8 @@ enum block_type
 
 const char *block_type_name (enum block_type);
 
+void block_init (void);
+
 /* Finding block devices. */
 struct block *block_get_role (enum block_type);
 void block_set_role (enum block_type, struct block *);
@@ -53,22 +58,101 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
+enum io_purpose block_set_purpose (enum io_purpose);
+
+/* Priority classes of requests, most urgent first.  A device
+   serves the most urgent class it has requests in, except that a
+   request in any class is served once its deadline passes. */
+enum io_class
+  {
+    IO_CLASS_FAULT,             /* Needed to resolve a page fault. */
+    IO_CLASS_INTERACTIVE,       /* A thread is waiting for it (default). */
+    IO_CLASS_BACKGROUND,        /* Write-back that nobody waits for. */
+    IO_CLASS_IDLE,              /* Speculative, e.g. read-ahead. */
+    IO_CLASS_CNT
+  };
+
+enum io_class block_set_class (enum io_class);
+
+/* Asynchronous requests. */
+struct block_request;
+typedef void block_done_func (struct block_request *);
+
+/* A request to transfer sectors to or from a block device. */
+struct block_request
+  {
+    /* Set by the submitter. */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                         /* Write if true, else read. */
+    enum io_purpose purpose;            /* What the transfer is for. */
+    enum io_class class;                /* Priority class. */
+    block_done_func *done;              /* Called when complete. */
+    void *aux;                          /* For use by DONE. */
+
+    /* Owned by the block layer. */
+    struct block *block;                /* Device submitted to. */
+    block_sector_t dev_sector;          /* SECTOR in the servicing device. */
+    int64_t deadline;                   /* Serve by this timer tick. */
+    int64_t submit_usecs;               /* When submitted. */
+    bool queued;                        /* Not yet handed to the driver? */
+    struct list_elem elem;              /* Element in a request queue. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+void block_boost (struct block_request *, enum io_class);
 
 /* Statistics. */
 void block_print_stats (void);
+void block_get_stats (struct block *, struct iostat *);
 
 /* Lower-level interface to block device drivers. */
 
+struct block_channel;
+struct block_channel *block_channel_create (const char *name);
+
+/* One transfer of CNT consecutive sectors. */
+struct block_transfer
+  {
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                         /* Write if true, else read. */
+  };
+
+/* READ_MULTIPLE and WRITE_MULTIPLE transfer CNT consecutive
+   sectors at once.  A driver that cannot do better than one
+   sector at a time may leave them null.
+
+   TRANSFER_MANY, if nonnull, carries out CNT independent
+   transfers, which the device may work on at the same time, and
+   returns when all of them are complete. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+    void (*transfer_many) (void *aux, struct block_transfer *, size_t cnt);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
-                              const struct block_operations *, void *aux);
+                              const struct block_operations *, void *aux,
+                              struct block_channel *);
+struct block *block_register_partition (const char *name, enum block_type,
+                                        const char *extra_info,
+                                        struct block *parent,
+                                        block_sector_t start,
+                                        block_sector_t size);
 
 #endif /* devices/block.h */
@@ -5,13 +5,23 @@
 #include <stdio.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].
+
+   If the PCI IDE controller can act as a bus master, as the PIIX
+   that QEMU emulates does, disks that support it transfer data by
+   DMA: the driver gives the controller a table of physical
+   regions (PRDs), starts the command, and sleeps until the
+   completion interrupt while the controller moves the data.
+   Otherwise, or if a DMA transfer fails, the CPU moves each word
+   through the data register in PIO mode. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -34,6 +44,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +60,45 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Bus-master IDE registers, relative to a channel's BM_BASE. */
+#define BM_COMMAND 0                    /* Command. */
+#define BM_STATUS 2                     /* Status. */
+#define BM_PRDT 4                       /* PRD table physical address. */
+
+/* Bus-master command register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus-master status register bits. */
+#define BM_STA_ERR 0x02         /* Transfer failed (write 1 to clear). */
+#define BM_STA_INTR 0x04        /* Interrupt raised (write 1 to clear). */
+
+/* A physical region descriptor: one piece of a DMA buffer.  A
+   region may not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes, 0 for 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last region. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_BOUNDARY 65536      /* Regions may not cross this. */
+
+/* PRDs per channel, enough for MAX_COMMAND_SECTORS sectors. */
+#define PRD_CNT 4
+
+/* Most sectors transferred by one command.  The sector count
+   register holds 0 for 256. */
+#define MAX_COMMAND_SECTORS 256
+
+/* Most sectors per interrupt we ask for in multiple mode. */
+#define MAX_MULTIPLE 16
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +107,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt for READ and
+                                   WRITE MULTIPLE, or 0 if unsupported. */
+    bool dma;                   /* Use DMA for transfers? */
   };
 
 /* An ATA channel (aka controller).
@@ -72,7 +125,14 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus-master registers, or 0 if none. */
+
+    /* DMA regions.  Aligning the table to its size keeps it from
+       crossing a 64 kB boundary, as the controller requires. */
+    struct prd prdt[PRD_CNT] __attribute__ ((aligned (32)));
+
     struct ata_disk devices[2];     /* The devices on this channel. */
+    struct block_channel *io;       /* Block layer channel and thread. */
   };
 
 /* We support the two "legacy" ATA channels found in a standard PC. */
@@ -84,8 +144,9 @@ static struct block_operations ide_operations;
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, int max);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -101,8 +162,18 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  struct pci_device pci;
+  uint16_t bm_base = 0;
   size_t chan_no;
 
+  /* Look for a bus-master IDE controller. */
+  if (pci_find_class (0x01, 0x01, 0, &pci) && (pci.prog_if & 0x80))
+    {
+      bm_base = pci_io_base (&pci, 4);
+      if (bm_base != 0)
+        pci_enable (&pci, PCI_CMD_IO | PCI_CMD_MASTER);
+    }
+
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
       struct channel *c = &channels[chan_no];
@@ -126,6 +197,13 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->io = NULL;
+
+      /* Use DMA only if the channel is at its legacy ports, as
+         set by the controller's programming interface. */
+      c->bm_base = 0;
+      if (bm_base != 0 && (pci.prog_if & (chan_no == 0 ? 0x01 : 0x04)) == 0)
+        c->bm_base = bm_base + chan_no * 8;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +214,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -284,10 +364,13 @@ identify_ata_device (struct ata_disk *d)
   /* Calculate capacity.
      Read model name and serial number. */
   capacity = *(uint32_t *) &id[60 * 2];
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
+  d->dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x0100) != 0;
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
   snprintf (extra_info, sizeof extra_info,
-            "model \"%s\", serial \"%s\"", model, serial);
+            "model \"%s\", serial \"%s\"%s", model, serial,
+            d->dma ? ", DMA" : "");
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
@@ -303,12 +386,38 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
-  /* Register. */
+  /* Register.  Both disks on a channel share its I/O thread, so
+     that each channel has one transfer in flight at a time. */
+  if (c->io == NULL)
+    c->io = block_channel_create (c->name);
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
-                          &ide_operations, d);
+                          &ide_operations, d, c->io);
   partition_scan (block);
 }
 
+/* Enables READ and WRITE MULTIPLE on disk D, which reports that
+   it can transfer up to MAX sectors per interrupt with them.
+   Leaves them disabled if MAX is 0 or D rejects the command. */
+static void
+set_multiple_mode (struct ata_disk *d, int max)
+{
+  struct channel *c = d->channel;
+
+  d->multiple = 0;
+  if (max == 0)
+    return;
+  if (max > MAX_MULTIPLE)
+    max = MAX_MULTIPLE;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), max);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+    d->multiple = max;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +446,248 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Stores into *COMMAND the command disk D should use to read, or
+   write if WRITE is true, CNT sectors, and returns the number of
+   sectors it will transfer per interrupt. */
+static size_t
+choose_command (const struct ata_disk *d, size_t cnt, bool write,
+                uint8_t *command)
+{
+  if (d->multiple > 0 && cnt > 1)
+    {
+      *command = write ? CMD_WRITE_MULTIPLE : CMD_READ_MULTIPLE;
+      return d->multiple;
+    }
+  *command = write ? CMD_WRITE_SECTOR_RETRY : CMD_READ_SECTOR_RETRY;
+  return 1;
+}
+
+/* Reads CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO from disk D into BUFFER in PIO mode.  The disk
+   interrupts once per block of sectors.  D's channel must be
+   locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  uint8_t command;
+  size_t per_intr = choose_command (d, cnt, false, &command);
+  size_t i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, command);
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % per_intr == 0)
+        {
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+        }
+      input_sector (c, buffer + i * BLOCK_SECTOR_SIZE);
+    }
+}
+
+/* Writes CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO to disk D from BUFFER in PIO mode.  D's channel must be
+   locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  uint8_t command;
+  size_t per_intr = choose_command (d, cnt, true, &command);
+  size_t i;
+
+  /* The disk asks for the first block of sectors without an
+     interrupt, and interrupts after each block it takes. */
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, command);
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % per_intr == 0)
+        {
+          if (i > 0)
+            sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+        }
+      output_sector (c, buffer + i * BLOCK_SECTOR_SIZE);
+    }
+  sema_down (&c->completion_wait);
+}
+
+/* Transfers CNT sectors, at most MAX_COMMAND_SECTORS, starting
+   at SEC_NO between disk D and BUFFER by bus-master DMA, writing
+   to the disk if WRITE is true or reading from it otherwise.
+   The controller moves the data while the calling thread sleeps
+   until the completion interrupt.  D's channel must be locked.
+   Returns true if successful, false if the transfer failed. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool write)
+{
+  struct channel *c = d->channel;
+  uintptr_t addr = vtop (buffer);
+  size_t size = cnt * BLOCK_SECTOR_SIZE;
+  uint8_t bm_command = write ? 0 : BM_CMD_READ;
+  uint8_t bm_status;
+  size_t i;
+
+  /* Kernel memory is physically contiguous, so BUFFER needs a
+     new PRD only where it crosses a 64 kB boundary. */
+  for (i = 0; size > 0; i++)
+    {
+      size_t chunk = PRD_BOUNDARY - addr % PRD_BOUNDARY;
+      if (chunk > size)
+        chunk = size;
+      ASSERT (i < PRD_CNT);
+      c->prdt[i].addr = addr;
+      c->prdt[i].size = chunk % PRD_BOUNDARY;
+      c->prdt[i].flags = chunk == size ? PRD_EOT : 0;
+      addr += chunk;
+      size -= chunk;
+    }
+
+  outl (c->bm_base + BM_PRDT, vtop (c->prdt));
+  outb (c->bm_base + BM_COMMAND, bm_command);
+  outb (c->bm_base + BM_STATUS, BM_STA_ERR | BM_STA_INTR);
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (c->bm_base + BM_COMMAND, bm_command | BM_CMD_START);
+  sema_down (&c->completion_wait);
+
+  outb (c->bm_base + BM_COMMAND, bm_command);
+  bm_status = inb (c->bm_base + BM_STATUS);
+  outb (c->bm_base + BM_STATUS, BM_STA_ERR | BM_STA_INTR);
+  return ((bm_status & BM_STA_ERR) == 0
+          && (inb (reg_alt_status (c)) & STA_ERR) == 0);
+}
+
+/* Transfers CNT sectors, at most MAX_COMMAND_SECTORS, between
+   disk D and BUFFER, as dma_transfer() does, if D can do DMA.
+   Returns true if successful, false if the caller should use PIO
+   instead.  A disk whose DMA transfer fails is used with PIO from
+   then on. */
+static bool
+try_dma (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+         void *buffer, bool write)
+{
+  if (!d->dma || !is_kernel_vaddr (buffer))
+    return false;
+  if (dma_transfer (d, sec_no, cnt, buffer, write))
+    return true;
+
+  printf ("%s: DMA %s failed, sector=%"PRDSNu"; using PIO\n",
+          d->name, write ? "write" : "read", sec_no);
+  d->dma = false;
+  wait_until_idle (d);
+  return false;
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Each
+   command transfers up to MAX_COMMAND_SECTORS sectors, by DMA if
+   possible.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+
+      if (!try_dma (d, sec_no, n, buffer, false))
+        pio_read (d, sec_no, n, buffer);
+      sec_no += n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving the data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+
+      if (!try_dma (d, sec_no, n, (void *) buffer, true))
+        pio_write (d, sec_no, n, buffer);
+      sec_no += n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d, sec_no, 1, buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d, sec_no, 1, buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    NULL
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the number of sectors CNT to the disk's
+   sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_COMMAND_SECTORS);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_COMMAND_SECTORS);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
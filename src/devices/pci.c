@@ -0,0 +1,173 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/io.h"
+
+/* This code reads and writes PCI configuration space through
+   configuration mechanism #1, which every PC since the Pentium
+   provides.  It does no resource assignment of its own: the BIOS
+   has already given each device its I/O ports and interrupt, so
+   drivers only need to find their device and read them back. */
+
+/* Configuration mechanism #1 I/O ports. */
+#define PCI_CONFIG_ADDRESS 0xcf8        /* Selects a register. */
+#define PCI_CONFIG_DATA 0xcfc           /* Reads or writes it. */
+
+/* Limits of the bus topology. */
+#define PCI_BUS_CNT 256
+#define PCI_SLOT_CNT 32
+#define PCI_FUNC_CNT 8
+
+/* Returns the configuration address of register REG of function
+   FUNC of device SLOT on BUS. */
+static uint32_t
+config_address (uint8_t bus, uint8_t slot, uint8_t func, uint8_t reg)
+{
+  return (0x80000000u | ((uint32_t) bus << 16) | ((uint32_t) slot << 11)
+          | ((uint32_t) func << 8) | (reg & 0xfc));
+}
+
+/* Reads 32-bit register REG of the given function. */
+static uint32_t
+read_config (uint8_t bus, uint8_t slot, uint8_t func, uint8_t reg)
+{
+  outl (PCI_CONFIG_ADDRESS, config_address (bus, slot, func, reg));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Function that decides whether D is the device wanted.  AUX is
+   passed through from find(). */
+typedef bool match_func (const struct pci_device *d, const void *aux);
+
+/* Searches every function on every bus for those for which
+   MATCH returns true, and stores the one with index IDX among
+   them, counting from 0, in *D.
+   Returns true if one is found, false otherwise. */
+static bool
+find (match_func *match, const void *aux, int idx, struct pci_device *d)
+{
+  int bus, slot, func;
+
+  for (bus = 0; bus < PCI_BUS_CNT; bus++)
+    for (slot = 0; slot < PCI_SLOT_CNT; slot++)
+      for (func = 0; func < PCI_FUNC_CNT; func++)
+        {
+          uint32_t id = read_config (bus, slot, func, PCI_REG_ID);
+          uint32_t class;
+
+          if ((id & 0xffff) == 0xffff)
+            {
+              /* No device, or no function 0 means no device. */
+              if (func == 0)
+                break;
+              continue;
+            }
+
+          class = read_config (bus, slot, func, PCI_REG_CLASS);
+          d->bus = bus;
+          d->slot = slot;
+          d->func = func;
+          d->vendor_id = id & 0xffff;
+          d->device_id = id >> 16;
+          d->class = class >> 24;
+          d->subclass = class >> 16;
+          d->prog_if = class >> 8;
+          if (match (d, aux) && idx-- == 0)
+            return true;
+
+          /* Only multifunction devices have functions past 0. */
+          if (func == 0
+              && !(read_config (bus, slot, 0, PCI_REG_HEADER) & 0x800000))
+            break;
+        }
+  return false;
+}
+
+/* Returns true if D has the vendor and device IDs in the array
+   of two uint16_t at IDS_. */
+static bool
+match_device (const struct pci_device *d, const void *ids_)
+{
+  const uint16_t *ids = ids_;
+  return d->vendor_id == ids[0] && d->device_id == ids[1];
+}
+
+/* Returns true if D has the class and subclass in the array of
+   two uint8_t at CLASS_. */
+static bool
+match_class (const struct pci_device *d, const void *class_)
+{
+  const uint8_t *class = class_;
+  return d->class == class[0] && d->subclass == class[1];
+}
+
+/* Finds function number IDX, counting from 0 in bus order, among
+   those with the given VENDOR_ID and DEVICE_ID, and stores it in
+   *D.  Returns true if successful, false if there is none. */
+bool
+pci_find_device (uint16_t vendor_id, uint16_t device_id, int idx,
+                 struct pci_device *d)
+{
+  uint16_t ids[2] = { vendor_id, device_id };
+  return find (match_device, ids, idx, d);
+}
+
+/* Finds function number IDX, counting from 0 in bus order, among
+   those with the given CLASS and SUBCLASS, and stores it in *D.
+   Returns true if successful, false if there is none. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, int idx,
+                struct pci_device *d)
+{
+  uint8_t codes[2] = { class, subclass };
+  return find (match_class, codes, idx, d);
+}
+
+/* Returns the 32-bit configuration register at offset REG, which
+   must be a multiple of 4, of D. */
+uint32_t
+pci_read_config (const struct pci_device *d, uint8_t reg)
+{
+  ASSERT (reg % 4 == 0);
+  return read_config (d->bus, d->slot, d->func, reg);
+}
+
+/* Sets the 32-bit configuration register at offset REG, which
+   must be a multiple of 4, of D to VALUE. */
+void
+pci_write_config (const struct pci_device *d, uint8_t reg, uint32_t value)
+{
+  ASSERT (reg % 4 == 0);
+  outl (PCI_CONFIG_ADDRESS, config_address (d->bus, d->slot, d->func, reg));
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Returns the first I/O port of base address register BAR of D,
+   or 0 if BAR is not assigned I/O space. */
+uint16_t
+pci_io_base (const struct pci_device *d, int bar)
+{
+  uint32_t value;
+
+  ASSERT (bar >= 0 && bar < 6);
+  value = pci_read_config (d, PCI_REG_BAR0 + bar * 4);
+  return (value & 1) ? value & 0xfffc : 0;
+}
+
+/* Returns the interrupt line the BIOS assigned to D. */
+uint8_t
+pci_irq (const struct pci_device *d)
+{
+  return pci_read_config (d, PCI_REG_INTR) & 0xff;
+}
+
+/* Sets COMMAND_BITS, some of PCI_CMD_*, in D's command
+   register. */
+void
+pci_enable (const struct pci_device *d, uint16_t command_bits)
+{
+  uint32_t value = pci_read_config (d, PCI_REG_COMMAND);
+
+  /* The upper half is the status register, whose bits are
+     cleared by writing 1s, so write zeros there. */
+  pci_write_config (d, PCI_REG_COMMAND, (value & 0xffff) | command_bits);
+}
@@ -0,0 +1,44 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A function of a device on the PCI bus. */
+struct pci_device
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t slot;               /* Device number on the bus. */
+    uint8_t func;               /* Function number within the device. */
+    uint16_t vendor_id;         /* Vendor ID. */
+    uint16_t device_id;         /* Device ID. */
+    uint8_t class;              /* Base class code. */
+    uint8_t subclass;           /* Subclass code. */
+    uint8_t prog_if;            /* Programming interface. */
+  };
+
+/* Configuration space registers common to all devices. */
+#define PCI_REG_ID 0x00         /* Vendor ID, Device ID. */
+#define PCI_REG_COMMAND 0x04    /* Command (16 bits). */
+#define PCI_REG_CLASS 0x08      /* Revision, Prog IF, Subclass, Class. */
+#define PCI_REG_HEADER 0x0c     /* Header type in bits 23:16. */
+#define PCI_REG_BAR0 0x10       /* First of six base address registers. */
+#define PCI_REG_INTR 0x3c       /* Interrupt line (8 bits). */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* Allow bus mastering. */
+
+bool pci_find_device (uint16_t vendor_id, uint16_t device_id, int idx,
+                      struct pci_device *);
+bool pci_find_class (uint8_t class, uint8_t subclass, int idx,
+                     struct pci_device *);
+
+uint32_t pci_read_config (const struct pci_device *, uint8_t reg);
+void pci_write_config (const struct pci_device *, uint8_t reg,
+                       uint32_t value);
+uint16_t pci_io_base (const struct pci_device *, int bar);
+uint8_t pci_irq (const struct pci_device *);
+void pci_enable (const struct pci_device *, uint16_t command_bits);
+
+#endif /* devices/pci.h */
@@ -0,0 +1,116 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A RAM disk is a block device whose sectors live in kernel
+   memory.  Transfers are just copies, so it has no seek or
+   emulation cost: as a swap device it isolates the cost of paging
+   from the cost of the disk, and as a file system device it
+   isolates the cost of the file system.
+
+   Its pages come from the kernel pool, one at a time so that they
+   need not be contiguous.  The "-ul" option can be used to leave
+   more memory in the kernel pool for a large RAM disk. */
+
+/* Sectors per page. */
+#define PAGE_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* The RAM disk. */
+static uint8_t **pages;                 /* Pages holding the sectors. */
+
+static struct block_operations ramdisk_operations;
+
+/* Creates a RAM disk of KB kilobytes, rounded up to a whole number
+   of pages, and registers it as block device "ram0".  The disk
+   starts out zeroed. */
+void
+ramdisk_init (size_t kb)
+{
+  size_t page_cnt = DIV_ROUND_UP (kb * 1024, PGSIZE);
+  size_t i;
+
+  ASSERT (pages == NULL);
+  if (page_cnt == 0)
+    return;
+
+  pages = malloc (page_cnt * sizeof *pages);
+  if (pages == NULL)
+    PANIC ("Failed to allocate memory for RAM disk");
+  for (i = 0; i < page_cnt; i++)
+    {
+      pages[i] = palloc_get_page (PAL_ZERO);
+      if (pages[i] == NULL)
+        PANIC ("RAM disk of %zu kB does not fit in the kernel pool", kb);
+    }
+
+  block_register ("ram0", BLOCK_RAW, "RAM disk", page_cnt * PAGE_SECTORS,
+                  &ramdisk_operations, NULL, NULL);
+}
+
+/* Copies CNT sectors between the RAM disk, starting at SEC_NO, and
+   BUFFER: into BUFFER if WRITE is false, from it if WRITE is
+   true. */
+static void
+copy_sectors (block_sector_t sec_no, size_t cnt, uint8_t *buffer, bool write)
+{
+  while (cnt > 0)
+    {
+      uint8_t *page = pages[sec_no / PAGE_SECTORS];
+      size_t ofs = sec_no % PAGE_SECTORS;
+      size_t chunk = PAGE_SECTORS - ofs < cnt ? PAGE_SECTORS - ofs : cnt;
+      uint8_t *sector = page + ofs * BLOCK_SECTOR_SIZE;
+
+      if (write)
+        memcpy (sector, buffer, chunk * BLOCK_SECTOR_SIZE);
+      else
+        memcpy (buffer, sector, chunk * BLOCK_SECTOR_SIZE);
+      sec_no += chunk;
+      buffer += chunk * BLOCK_SECTOR_SIZE;
+      cnt -= chunk;
+    }
+}
+
+/* Reads CNT sectors starting at SEC_NO into BUFFER. */
+static void
+ramdisk_read_multiple (void *aux UNUSED, block_sector_t sec_no, size_t cnt,
+                       void *buffer)
+{
+  copy_sectors (sec_no, cnt, buffer, false);
+}
+
+/* Writes CNT sectors starting at SEC_NO from BUFFER. */
+static void
+ramdisk_write_multiple (void *aux UNUSED, block_sector_t sec_no, size_t cnt,
+                        const void *buffer)
+{
+  copy_sectors (sec_no, cnt, (uint8_t *) buffer, true);
+}
+
+/* Reads sector SEC_NO into BUFFER. */
+static void
+ramdisk_read (void *aux UNUSED, block_sector_t sec_no, void *buffer)
+{
+  copy_sectors (sec_no, 1, buffer, false);
+}
+
+/* Writes sector SEC_NO from BUFFER. */
+static void
+ramdisk_write (void *aux UNUSED, block_sector_t sec_no, const void *buffer)
+{
+  copy_sectors (sec_no, 1, (uint8_t *) buffer, true);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_read_multiple,
+    ramdisk_write_multiple,
+    NULL
+  };
@@ -76,6 +76,29 @@ timer_ticks (void)
   return t;
 }
 
+/* Returns the number of microseconds since the OS booted.  Unlike
+   timer_ticks(), this resolves time within a tick, by reading how
+   far the PIT has counted toward the next one. */
+int64_t
+timer_usecs (void)
+{
+  const unsigned period = (PIT_HZ + TIMER_FREQ / 2) / TIMER_FREQ;
+  enum intr_level old_level = intr_disable ();
+  int64_t t = ticks;
+  unsigned count = pit_read_counter (0);
+
+  /* If the counter has started another period but the timer
+     interrupt for the end of the last one is still pending, the
+     tick is not yet in TICKS.  A count near the top of the period
+     means the counter wrapped before it was read. */
+  if (intr_ext_pending (0x20) && count > period / 2)
+    t++;
+  intr_set_level (old_level);
+
+  return (t * 1000000 / TIMER_FREQ
+          + (int64_t) (period - count) * 1000000 / PIT_HZ);
+}
+
 /* Returns the number of timer ticks elapsed since THEN, which
    should be a value once returned by timer_ticks(). */
 int64_t
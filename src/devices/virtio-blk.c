@@ -0,0 +1,372 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <packed.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file drives virtio block devices through the
+   legacy virtio PCI interface (virtio 0.9.5), which QEMU offers
+   for "-drive if=virtio".  It attempts to comply with [Virtio].
+
+   The driver and the device share a virtqueue in memory.  To
+   issue a request the driver links three descriptors, for the
+   request header, the data and a status byte, puts the first in
+   the available ring, and notifies the device with an I/O port
+   write.  The device puts finished requests in the used ring and
+   raises an interrupt.  Emulating a port write is expensive, so
+   the driver posts every transfer the block layer hands it at
+   once and notifies the device a single time. */
+
+/* Vendor and device IDs of a legacy virtio block device. */
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLK_DEVICE 0x1001
+
+/* Legacy virtio registers, relative to BAR 0. */
+#define REG_GUEST_FEATURES 0x04 /* Features the driver uses (32 bits). */
+#define REG_QUEUE_PFN 0x08      /* Queue page frame number (32 bits). */
+#define REG_QUEUE_SIZE 0x0c     /* Queue size (16 bits). */
+#define REG_QUEUE_SELECT 0x0e   /* Queue selector (16 bits). */
+#define REG_QUEUE_NOTIFY 0x10   /* Queue notifier (16 bits). */
+#define REG_STATUS 0x12         /* Device status (8 bits). */
+#define REG_ISR 0x13            /* Interrupt status, cleared on read. */
+#define REG_CAPACITY 0x14       /* Capacity in sectors (64 bits). */
+
+/* Device status bits. */
+#define STATUS_ACKNOWLEDGE 0x01 /* Guest noticed the device. */
+#define STATUS_DRIVER 0x02      /* Guest has a driver for it. */
+#define STATUS_DRIVER_OK 0x04   /* Driver is ready. */
+#define STATUS_FAILED 0x80      /* Driver gave up. */
+
+/* Virtqueue descriptor flags. */
+#define DESC_NEXT 0x01          /* NEXT is valid. */
+#define DESC_WRITE 0x02         /* Device writes the buffer. */
+
+/* Request types and status values. */
+#define REQ_IN 0                /* Read. */
+#define REQ_OUT 1               /* Write. */
+#define REQ_OK 0                /* Success. */
+
+/* A virtqueue buffer descriptor. */
+struct vq_desc
+  {
+    uint64_t addr;              /* Physical address. */
+    uint32_t len;               /* Length in bytes. */
+    uint16_t flags;             /* DESC_* flags. */
+    uint16_t next;              /* Next descriptor in the chain. */
+  } PACKED;
+
+/* The available ring, written by the driver. */
+struct vq_avail
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the driver puts the next entry. */
+    uint16_t ring[];            /* Heads of descriptor chains. */
+  } PACKED;
+
+/* An entry in the used ring. */
+struct vq_used_elem
+  {
+    uint32_t id;                /* Head of the finished chain. */
+    uint32_t len;               /* Bytes written by the device. */
+  } PACKED;
+
+/* The used ring, written by the device. */
+struct vq_used
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the device puts the next entry. */
+    struct vq_used_elem ring[];
+  } PACKED;
+
+/* Header at the start of each request. */
+struct request_header
+  {
+    uint32_t type;              /* REQ_IN or REQ_OUT. */
+    uint32_t ioprio;            /* Not used. */
+    uint64_t sector;            /* First sector. */
+  } PACKED;
+
+/* Most requests outstanding at once.  Each uses three
+   descriptors. */
+#define MAX_REQUESTS 16
+
+/* A request slot: the header and status byte of a request. */
+struct slot
+  {
+    struct request_header header;
+    uint8_t status;
+  };
+
+/* A virtio block device. */
+struct virtio_blk
+  {
+    char name[8];               /* Name, e.g. "vda". */
+    uint16_t io_base;           /* Base of the legacy registers. */
+    uint8_t irq;                /* Interrupt vector. */
+
+    /* The virtqueue. */
+    uint16_t queue_size;        /* Number of descriptors. */
+    volatile struct vq_desc *desc;      /* Descriptor table. */
+    volatile struct vq_avail *avail;    /* Available ring. */
+    volatile struct vq_used *used;      /* Used ring. */
+    uint16_t last_used;         /* Used ring entries consumed so far. */
+    struct slot *slots;         /* MAX_REQUESTS request slots. */
+    struct semaphore completion;        /* Up'd by interrupt handler. */
+  };
+
+/* Most virtio block devices supported. */
+#define MAX_DEVICES 8
+static struct virtio_blk *devices[MAX_DEVICES];
+static size_t device_cnt;
+
+static struct block_operations virtio_blk_operations;
+
+static bool init_device (struct virtio_blk *, const struct pci_device *);
+static void interrupt_handler (struct intr_frame *);
+
+/* Finds and registers the virtio block devices. */
+void
+virtio_blk_init (void)
+{
+  struct pci_device pci;
+  int idx;
+
+  for (idx = 0; device_cnt < MAX_DEVICES
+                && pci_find_device (VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, idx,
+                                    &pci); idx++)
+    {
+      struct virtio_blk *d = malloc (sizeof *d);
+      block_sector_t capacity;
+      struct block *block;
+
+      if (d == NULL)
+        PANIC ("Failed to allocate memory for virtio device");
+      snprintf (d->name, sizeof d->name, "vd%c", 'a' + (int) device_cnt);
+      if (!init_device (d, &pci))
+        {
+          printf ("%s: initialization failed\n", d->name);
+          free (d);
+          continue;
+        }
+      devices[device_cnt++] = d;
+
+      capacity = inl (d->io_base + REG_CAPACITY);
+      if (inl (d->io_base + REG_CAPACITY + 4) != 0)
+        capacity = (block_sector_t) -1;
+      block = block_register (d->name, BLOCK_RAW, "virtio", capacity,
+                              &virtio_blk_operations, d, NULL);
+      partition_scan (block);
+    }
+}
+
+/* Returns the offset of the used ring in a legacy virtqueue of
+   SIZE descriptors: it follows the descriptor table and the
+   available ring, on a page boundary. */
+static size_t
+used_offset (uint16_t size)
+{
+  return ROUND_UP (sizeof (struct vq_desc) * size + sizeof (struct vq_avail)
+                   + sizeof (uint16_t) * (size + 1), PGSIZE);
+}
+
+/* Returns the number of bytes in a legacy virtqueue of SIZE
+   descriptors. */
+static size_t
+queue_bytes (uint16_t size)
+{
+  return used_offset (size) + ROUND_UP (sizeof (struct vq_used)
+                                        + sizeof (struct vq_used_elem) * size
+                                        + sizeof (uint16_t), PGSIZE);
+}
+
+/* Initializes D, the virtio block device PCI: resets it, sets up
+   its virtqueue and interrupt, and tells it the driver is ready.
+   Returns true if successful, false on failure. */
+static bool
+init_device (struct virtio_blk *d, const struct pci_device *pci)
+{
+  size_t i, page_cnt;
+  uint8_t *queue;
+
+  d->io_base = pci_io_base (pci, 0);
+  d->irq = pci_irq (pci) + 0x20;
+  if (d->io_base == 0 || d->irq > 0x2f)
+    return false;
+  pci_enable (pci, PCI_CMD_IO | PCI_CMD_MASTER);
+
+  /* Reset, then acknowledge the device.  We use no optional
+     features. */
+  outb (d->io_base + REG_STATUS, 0);
+  outb (d->io_base + REG_STATUS, STATUS_ACKNOWLEDGE);
+  outb (d->io_base + REG_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+  outl (d->io_base + REG_GUEST_FEATURES, 0);
+
+  /* Set up request queue 0, in physically contiguous pages. */
+  outw (d->io_base + REG_QUEUE_SELECT, 0);
+  d->queue_size = inw (d->io_base + REG_QUEUE_SIZE);
+  if (d->queue_size < 3 * MAX_REQUESTS)
+    goto fail;
+  page_cnt = queue_bytes (d->queue_size) / PGSIZE;
+  queue = palloc_get_multiple (PAL_ZERO, page_cnt);
+  d->slots = calloc (MAX_REQUESTS, sizeof *d->slots);
+  if (queue == NULL || d->slots == NULL)
+    {
+      palloc_free_multiple (queue, page_cnt);
+      free (d->slots);
+      goto fail;
+    }
+  d->desc = (struct vq_desc *) queue;
+  d->avail = (struct vq_avail *) (queue + sizeof (struct vq_desc)
+                                          * d->queue_size);
+  d->used = (struct vq_used *) (queue + used_offset (d->queue_size));
+  d->last_used = 0;
+  sema_init (&d->completion, 0);
+
+  /* Each slot's chain is fixed: header, data, status. */
+  for (i = 0; i < MAX_REQUESTS; i++)
+    {
+      volatile struct vq_desc *desc = &d->desc[i * 3];
+
+      desc[0].addr = vtop (&d->slots[i].header);
+      desc[0].len = sizeof d->slots[i].header;
+      desc[0].flags = DESC_NEXT;
+      desc[0].next = i * 3 + 1;
+      desc[1].flags = DESC_NEXT;
+      desc[1].next = i * 3 + 2;
+      desc[2].addr = vtop (&d->slots[i].status);
+      desc[2].len = 1;
+      desc[2].flags = DESC_WRITE;
+    }
+  outl (d->io_base + REG_QUEUE_PFN, vtop (queue) >> PGBITS);
+
+  /* Devices may share an interrupt line. */
+  for (i = 0; i < device_cnt; i++)
+    if (devices[i]->irq == d->irq)
+      break;
+  if (i == device_cnt)
+    intr_register_ext (d->irq, interrupt_handler, "virtio-blk");
+
+  outb (d->io_base + REG_STATUS,
+        STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+  return true;
+
+ fail:
+  outb (d->io_base + REG_STATUS, STATUS_FAILED);
+  return false;
+}
+
+/* Carries out the CNT transfers in XFERS on device D_: posts them
+   all to the virtqueue, notifies the device once, and sleeps
+   until the device has finished all of them. */
+static void
+virtio_blk_transfer_many (void *d_, struct block_transfer *xfers,
+                          size_t cnt)
+{
+  struct virtio_blk *d = d_;
+  uint16_t avail_idx = d->avail->idx;
+  size_t i;
+
+  ASSERT (cnt <= MAX_REQUESTS);
+  for (i = 0; i < cnt; i++)
+    {
+      struct block_transfer *x = &xfers[i];
+      volatile struct vq_desc *data = &d->desc[i * 3 + 1];
+
+      ASSERT (is_kernel_vaddr (x->buffer));
+      d->slots[i].header.type = x->write ? REQ_OUT : REQ_IN;
+      d->slots[i].header.ioprio = 0;
+      d->slots[i].header.sector = x->sector;
+      d->slots[i].status = 0xff;
+
+      /* Kernel memory is physically contiguous. */
+      data->addr = vtop (x->buffer);
+      data->len = x->cnt * BLOCK_SECTOR_SIZE;
+      data->flags = DESC_NEXT | (x->write ? 0 : DESC_WRITE);
+      d->avail->ring[(uint16_t) (avail_idx + i) % d->queue_size] = i * 3;
+    }
+
+  /* Make the ring entries visible before the index, and the index
+     before the notification. */
+  barrier ();
+  d->avail->idx = avail_idx + cnt;
+  barrier ();
+  outw (d->io_base + REG_QUEUE_NOTIFY, 0);
+
+  while ((uint16_t) (d->used->idx - d->last_used) < cnt)
+    sema_down (&d->completion);
+  barrier ();
+  d->last_used += cnt;
+
+  for (i = 0; i < cnt; i++)
+    if (d->slots[i].status != REQ_OK)
+      PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+             xfers[i].write ? "write" : "read", xfers[i].sector);
+}
+
+/* Reads CNT sectors starting at SEC_NO from device D into
+   BUFFER. */
+static void
+virtio_blk_read_multiple (void *d, block_sector_t sec_no, size_t cnt,
+                          void *buffer)
+{
+  struct block_transfer x = { sec_no, cnt, buffer, false };
+  virtio_blk_transfer_many (d, &x, 1);
+}
+
+/* Writes CNT sectors starting at SEC_NO to device D from
+   BUFFER. */
+static void
+virtio_blk_write_multiple (void *d, block_sector_t sec_no, size_t cnt,
+                           const void *buffer)
+{
+  struct block_transfer x = { sec_no, cnt, (void *) buffer, true };
+  virtio_blk_transfer_many (d, &x, 1);
+}
+
+/* Reads sector SEC_NO from device D into BUFFER. */
+static void
+virtio_blk_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  virtio_blk_read_multiple (d, sec_no, 1, buffer);
+}
+
+/* Writes sector SEC_NO to device D from BUFFER. */
+static void
+virtio_blk_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  virtio_blk_write_multiple (d, sec_no, 1, buffer);
+}
+
+static struct block_operations virtio_blk_operations =
+  {
+    virtio_blk_read,
+    virtio_blk_write,
+    virtio_blk_read_multiple,
+    virtio_blk_write_multiple,
+    virtio_blk_transfer_many
+  };
+
+/* Virtio interrupt handler.  Reading a device's interrupt status
+   acknowledges its interrupt. */
+static void
+interrupt_handler (struct intr_frame *f)
+{
+  size_t i;
+
+  for (i = 0; i < device_cnt; i++)
+    {
+      struct virtio_blk *d = devices[i];
+      if (d->irq == f->vec_no && (inb (d->io_base + REG_ISR) & 1))
+        sema_up (&d->completion);
+    }
+}
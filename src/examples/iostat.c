@@ -0,0 +1,56 @@
+/* iostat.c
+
+   Prints the I/O statistics of the block devices named on the
+   command line, e.g. "iostat hda1 hdb1". */
+
+#include <stdio.h>
+#include <syscall.h>
+
+/* Names of the purposes in enum io_purpose. */
+static const char *purpose_names[IO_PURPOSE_CNT] =
+  {
+    "file data", "metadata", "swap-in", "swap-out", "mmap write-back",
+    "other",
+  };
+
+/* Prints latency histogram HIST, labeled LABEL. */
+static void
+print_histogram (const char *label, const unsigned long long *hist)
+{
+  int i;
+
+  printf ("  %s (us):", label);
+  for (i = 0; i < IO_HIST_BUCKETS - 1; i++)
+    if (hist[i] > 0)
+      printf (" <%llu:%llu", 1ULL << i, hist[i]);
+  if (hist[i] > 0)
+    printf (" >=%llu:%llu", 1ULL << (i - 1), hist[i]);
+  printf ("\n");
+}
+
+int
+main (int argc, char *argv[]) 
+{
+  bool success = true;
+  int i, j;
+
+  for (i = 1; i < argc; i++)
+    {
+      struct iostat s;
+
+      if (!iostat (argv[i], &s))
+        {
+          printf ("%s: no such block device\n", argv[i]);
+          success = false;
+          continue;
+        }
+      printf ("%s:\n", argv[i]);
+      for (j = 0; j < IO_PURPOSE_CNT; j++)
+        if (s.requests[j] > 0)
+          printf ("  %s: %llu requests, %llu bytes\n",
+                  purpose_names[j], s.requests[j], s.bytes[j]);
+      print_histogram ("queue wait", s.wait);
+      print_histogram ("service", s.service);
+    }
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,607 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <stdbool.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* The buffer cache keeps recently used sectors of the file
+   system device in memory.  Reads and writes are served from
+   the cache; dirty sectors are written back when they are
+   evicted, periodically by a write-behind thread, and when the
+   file system is shut down.  Sectors are replaced with the
+   clock algorithm.
+
+   Metadata is written with cache_write_meta_at(), which, when
+   the journal is enabled, also holds the entry: a held entry is
+   neither evicted nor written back until the journal has
+   committed its contents to the log and released it with
+   cache_release().
+
+   Each entry remembers whether it holds file data or metadata,
+   and whether it was last written to write back a memory-mapped
+   page, so that the block layer's statistics attribute its disk
+   transfers correctly.
+
+   The helper threads' transfers have low priority classes:
+   write-behind is background work and read-ahead is idle work,
+   so neither delays a thread that is waiting for the disk.  An
+   entry stays locked while its sector is transferred, so a thread
+   that comes to wait for an entry raises the class of the
+   transfer in progress to its own: otherwise a reader would wait
+   as long as the elevator may defer a low class, for the very
+   sector it asked to have read ahead. */
+
+/* Number of sectors held in the cache. */
+#define CACHE_SIZE 64
+
+/* Milliseconds between background flushes of dirty sectors. */
+#define WRITE_BEHIND_MS 1000
+
+/* Maximum number of queued read-ahead requests.  Further
+   requests are dropped until the queue drains. */
+#define READ_AHEAD_SLOTS 16
+
+/* Marks a cache entry that holds no sector. */
+#define SECTOR_NONE ((block_sector_t) -1)
+
+/* A cached sector.
+
+   SECTOR, ACCESSED, PIN_CNT, HELD, WAIT_CLASS and IO are
+   protected by cache_lock.
+   DATA and DIRTY are protected by LOCK.  An entry may only be
+   locked by a thread that has pinned it, so an entry with a zero
+   PIN_CNT is never locked and may be recycled under
+   cache_lock. */
+struct cache_entry
+  {
+    block_sector_t sector;              /* Cached sector, or SECTOR_NONE. */
+    bool dirty;                         /* Modified since last written? */
+    bool accessed;                      /* Used since the clock hand passed? */
+    int pin_cnt;                        /* Threads using or waiting on entry. */
+    bool held;                          /* Awaiting journal commit? */
+    enum io_class wait_class;           /* Most urgent class of pinners. */
+    struct block_request *io;           /* Transfer in progress, or null. */
+    struct lock lock;                   /* Serializes access to DATA. */
+    enum io_purpose purpose;            /* Purpose of transfers, under LOCK. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+/* Cache entries. */
+static struct cache_entry cache[CACHE_SIZE];
+
+/* Protects the mapping from sectors to entries. */
+static struct lock cache_lock;
+
+/* Next entry to consider for eviction. */
+static size_t clock_hand;
+
+/* Queue of sectors waiting to be read ahead. */
+static block_sector_t read_ahead_queue[READ_AHEAD_SLOTS];
+static size_t read_ahead_head;          /* Index of oldest request. */
+static size_t read_ahead_cnt;           /* Number of queued requests. */
+static struct lock read_ahead_lock;     /* Protects the queue. */
+static struct condition read_ahead_cond; /* Signaled on new requests. */
+
+static thread_func write_behind_thread NO_RETURN;
+static thread_func read_ahead_thread NO_RETURN;
+
+/* Initializes the buffer cache and starts its helper threads. */
+void
+cache_init (void)
+{
+  size_t i;
+
+  lock_init (&cache_lock);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      e->sector = SECTOR_NONE;
+      e->dirty = false;
+      e->accessed = false;
+      e->pin_cnt = 0;
+      e->held = false;
+      e->wait_class = IO_CLASS_CNT;
+      e->io = NULL;
+      lock_init (&e->lock);
+    }
+  clock_hand = 0;
+
+  lock_init (&read_ahead_lock);
+  cond_init (&read_ahead_cond);
+  read_ahead_head = read_ahead_cnt = 0;
+
+  thread_create ("write-behind", PRI_DEFAULT, write_behind_thread, NULL);
+  thread_create ("read-ahead", PRI_DEFAULT, read_ahead_thread, NULL);
+}
+
+/* Writes every dirty sector back to disk. */
+void
+cache_done (void)
+{
+  cache_flush ();
+}
+
+/* Returns the entry that holds SECTOR, or a null pointer if
+   SECTOR is not cached. */
+static struct cache_entry *
+lookup (block_sector_t sector)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].sector == sector)
+      return &cache[i];
+  return NULL;
+}
+
+/* Chooses an unpinned, unheld entry to recycle using the clock
+   algorithm, preferring entries that hold no sector.
+   Returns a null pointer if every entry is pinned or held. */
+static struct cache_entry *
+choose_victim (void)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  for (i = 0; i < 2 * CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+      if (e->pin_cnt > 0 || e->held)
+        continue;
+      if (e->sector == SECTOR_NONE || !e->accessed)
+        return e;
+      e->accessed = false;
+    }
+  return NULL;
+}
+
+/* Completion function for the requests of transfer(). */
+static void
+transfer_done (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Transfers E's sector between the disk and E's data, writing if
+   WRITE is true, counted as PURPOSE, and waits for it to finish.
+   The transfer is made in the running thread's class, or that of
+   the most urgent thread waiting for E if that is more urgent.
+   E must be locked by the current thread. */
+static void
+transfer (struct cache_entry *e, bool write, enum io_purpose purpose)
+{
+  struct block_request r;
+  struct semaphore done;
+
+  ASSERT (lock_held_by_current_thread (&e->lock));
+
+  sema_init (&done, 0);
+  r.sector = e->sector;
+  r.cnt = 1;
+  r.buffer = e->data;
+  r.write = write;
+  r.purpose = purpose;
+  r.class = thread_current ()->io_class;
+  r.done = transfer_done;
+  r.aux = &done;
+
+  lock_acquire (&cache_lock);
+  if (e->wait_class < r.class)
+    r.class = e->wait_class;
+  block_submit (fs_device, &r);
+  e->io = &r;
+  lock_release (&cache_lock);
+
+  sema_down (&done);
+
+  lock_acquire (&cache_lock);
+  e->io = NULL;
+  lock_release (&cache_lock);
+}
+
+/* Records that the running thread has pinned E to wait for it,
+   raising the transfer of E in progress, if any, to the running
+   thread's class. */
+static void
+boost (struct cache_entry *e)
+{
+  enum io_class class = thread_current ()->io_class;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  if (class < e->wait_class)
+    {
+      e->wait_class = class;
+      if (e->io != NULL)
+        block_boost (e->io, class);
+    }
+}
+
+/* Writes E back to disk if it is dirty and not held for the
+   journal.  E must be locked by the current thread, which keeps
+   it from becoming held meanwhile. */
+static void
+write_back (struct cache_entry *e)
+{
+  bool held;
+
+  ASSERT (lock_held_by_current_thread (&e->lock));
+  lock_acquire (&cache_lock);
+  held = e->held;
+  lock_release (&cache_lock);
+  if (e->dirty && !held)
+    {
+      transfer (e, true, e->purpose);
+      e->dirty = false;
+    }
+}
+
+/* Drops one pin from E. */
+static void
+unpin (struct cache_entry *e)
+{
+  lock_acquire (&cache_lock);
+  ASSERT (e->pin_cnt > 0);
+  if (--e->pin_cnt == 0)
+    e->wait_class = IO_CLASS_CNT;
+  lock_release (&cache_lock);
+}
+
+/* Returns the entry for SECTOR, pinned and locked by the
+   current thread, bringing it into the cache if necessary, for
+   the given PURPOSE.  If READ is false then the caller is about
+   to overwrite the whole sector, so the old contents are not read
+   from disk. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool read, enum io_purpose purpose)
+{
+  ASSERT (sector != SECTOR_NONE);
+
+  for (;;)
+    {
+      struct cache_entry *e;
+
+      lock_acquire (&cache_lock);
+      e = lookup (sector);
+      if (e != NULL)
+        {
+          e->pin_cnt++;
+          e->accessed = true;
+          boost (e);
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          if (purpose == IO_FS_META)
+            e->purpose = IO_FS_META;
+          return e;
+        }
+
+      e = choose_victim ();
+      if (e == NULL)
+        {
+          /* Every entry is in use.  Let their holders finish,
+             and the journal release what it holds. */
+          lock_release (&cache_lock);
+          journal_wake ();
+          thread_yield ();
+          continue;
+        }
+
+      if (e->dirty)
+        {
+          /* Clean the victim without holding cache_lock, so that
+             hits on other sectors are not stalled behind the
+             write, then start over. */
+          e->pin_cnt++;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          write_back (e);
+          lock_release (&e->lock);
+          unpin (e);
+          continue;
+        }
+
+      /* E is clean and unpinned, so nobody holds its lock and
+         the disk already has its contents. */
+      e->sector = sector;
+      e->accessed = true;
+      e->pin_cnt = 1;
+      lock_acquire (&e->lock);
+      lock_release (&cache_lock);
+      e->purpose = purpose;
+      if (read)
+        transfer (e, false, purpose);
+      return e;
+    }
+}
+
+/* Unlocks and unpins E, which was returned by cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+  unpin (e);
+}
+
+/* Returns a SIZE-byte bounce buffer for copying to or from a user
+   page, which the caller must free.  It comes from the heap
+   because this is often nested deep in system call and page
+   fault frames, with little of the kernel stack to spare. */
+static uint8_t *
+alloc_bounce (int size)
+{
+  uint8_t *bounce = malloc (size > 0 ? size : 1);
+  if (bounce == NULL)
+    PANIC ("out of memory for cache bounce buffer");
+  return bounce;
+}
+
+/* Reads SIZE bytes starting at SECTOR_OFS within SECTOR, which
+   holds data for PURPOSE, into BUFFER. */
+static void
+read_at (block_sector_t sector, void *buffer, int sector_ofs, int size,
+         enum io_purpose purpose)
+{
+  struct cache_entry *e;
+
+  ASSERT (sector_ofs >= 0 && size >= 0);
+  ASSERT (sector_ofs + size <= BLOCK_SECTOR_SIZE);
+
+  if (is_user_vaddr (buffer))
+    {
+      /* Touching a user page may fault, and servicing the fault
+         may need this very entry, so copy through a bounce
+         buffer after unlocking it. */
+      uint8_t *bounce = alloc_bounce (size);
+      read_at (sector, bounce, sector_ofs, size, purpose);
+      memcpy (buffer, bounce, size);
+      free (bounce);
+      return;
+    }
+
+  e = cache_get (sector, true, purpose);
+  memcpy (buffer, e->data + sector_ofs, size);
+  cache_put (e);
+}
+
+/* Reads SIZE bytes of file data starting at SECTOR_OFS within
+   SECTOR into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, int sector_ofs, int size)
+{
+  read_at (sector, buffer, sector_ofs, size, IO_FS_DATA);
+}
+
+/* Reads SIZE bytes of metadata starting at SECTOR_OFS within
+   SECTOR into BUFFER. */
+void
+cache_read_meta_at (block_sector_t sector, void *buffer, int sector_ofs,
+                    int size)
+{
+  read_at (sector, buffer, sector_ofs, size, IO_FS_META);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR, starting at
+   SECTOR_OFS.  The data reaches the disk later, counted as
+   PURPOSE. */
+static void
+write_at (block_sector_t sector, const void *buffer, int sector_ofs,
+          int size, enum io_purpose purpose)
+{
+  struct cache_entry *e;
+
+  ASSERT (sector_ofs >= 0 && size >= 0);
+  ASSERT (sector_ofs + size <= BLOCK_SECTOR_SIZE);
+
+  if (is_user_vaddr (buffer))
+    {
+      /* As in cache_read_at(), touch the user page before
+         locking the entry. */
+      uint8_t *bounce = alloc_bounce (size);
+      memcpy (bounce, buffer, size);
+      write_at (sector, bounce, sector_ofs, size, purpose);
+      free (bounce);
+      return;
+    }
+
+  e = cache_get (sector, sector_ofs != 0 || size != BLOCK_SECTOR_SIZE,
+                 purpose);
+  memcpy (e->data + sector_ofs, buffer, size);
+  e->dirty = true;
+  e->purpose = purpose;
+  cache_put (e);
+}
+
+/* Writes SIZE bytes of file data from BUFFER into SECTOR,
+   starting at SECTOR_OFS.  The data reaches the disk later.  If
+   the running thread is writing back a memory-mapped page, the
+   disk transfer is counted as such. */
+void
+cache_write_at (block_sector_t sector, const void *buffer,
+                int sector_ofs, int size)
+{
+  enum io_purpose purpose = thread_current ()->io_purpose;
+  write_at (sector, buffer, sector_ofs, size,
+            purpose == IO_MMAP_WRITEBACK ? IO_MMAP_WRITEBACK : IO_FS_DATA);
+}
+
+/* Writes SIZE bytes of metadata from BUFFER into SECTOR,
+   starting at SECTOR_OFS, as part of the running journal
+   transaction.  The data reaches the disk after the transaction
+   commits. */
+void
+cache_write_meta_at (block_sector_t sector, const void *buffer,
+                     int sector_ofs, int size)
+{
+  struct cache_entry *e;
+
+  ASSERT (sector_ofs >= 0 && size >= 0);
+  ASSERT (sector_ofs + size <= BLOCK_SECTOR_SIZE);
+  ASSERT (!is_user_vaddr (buffer));
+
+  if (!journal_enabled ())
+    {
+      write_at (sector, buffer, sector_ofs, size, IO_FS_META);
+      return;
+    }
+
+  e = cache_get (sector, sector_ofs != 0 || size != BLOCK_SECTOR_SIZE,
+                 IO_FS_META);
+  memcpy (e->data + sector_ofs, buffer, size);
+  e->dirty = true;
+  e->purpose = IO_FS_META;
+  lock_acquire (&cache_lock);
+  e->held = true;
+  lock_release (&cache_lock);
+  cache_put (e);
+
+  journal_add (sector);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes of metadata from BUFFER into
+   SECTOR, as cache_write_meta_at() does. */
+void
+cache_write_meta (block_sector_t sector, const void *buffer)
+{
+  cache_write_meta_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Lets SECTOR, whose contents the journal has committed, be
+   written back and evicted again. */
+void
+cache_release (block_sector_t sector)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  e = lookup (sector);
+  if (e != NULL)
+    e->held = false;
+  lock_release (&cache_lock);
+}
+
+/* Drops every sector from the cache, writing back any that are
+   dirty, so that later reads see what is on disk.  Used after
+   the journal has been replayed directly to disk.  No other
+   thread may be using the cache. */
+void
+cache_invalidate (void)
+{
+  size_t i;
+
+  cache_flush ();
+  lock_acquire (&cache_lock);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      ASSERT (cache[i].pin_cnt == 0 && !cache[i].dirty);
+      cache[i].sector = SECTOR_NONE;
+    }
+  lock_release (&cache_lock);
+}
+
+/* Reads SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads metadata SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read_meta (block_sector_t sector, void *buffer)
+{
+  cache_read_meta_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into SECTOR. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes all dirty sectors back to disk, except those held for
+   the journal. */
+void
+cache_flush (void)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+
+      lock_acquire (&cache_lock);
+      if (e->sector == SECTOR_NONE || !e->dirty || e->held)
+        {
+          lock_release (&cache_lock);
+          continue;
+        }
+      e->pin_cnt++;
+      lock_release (&cache_lock);
+
+      lock_acquire (&e->lock);
+      write_back (e);
+      cache_put (e);
+    }
+}
+
+/* Asks for SECTOR to be brought into the cache in the
+   background, in anticipation of a read in the near future. */
+void
+cache_read_ahead (block_sector_t sector)
+{
+  lock_acquire (&read_ahead_lock);
+  if (read_ahead_cnt < READ_AHEAD_SLOTS)
+    {
+      size_t tail = (read_ahead_head + read_ahead_cnt) % READ_AHEAD_SLOTS;
+      read_ahead_queue[tail] = sector;
+      read_ahead_cnt++;
+      cond_signal (&read_ahead_cond, &read_ahead_lock);
+    }
+  lock_release (&read_ahead_lock);
+}
+
+/* Periodically writes dirty sectors, including the parts of the
+   free map that changed, back to disk, so that little is lost if
+   the machine stops unexpectedly. */
+static void
+write_behind_thread (void *aux UNUSED)
+{
+  block_set_class (IO_CLASS_BACKGROUND);
+  for (;;)
+    {
+      timer_msleep (WRITE_BEHIND_MS);
+      filesys_sync ();
+    }
+}
+
+/* Services read-ahead requests. */
+static void
+read_ahead_thread (void *aux UNUSED)
+{
+  block_set_class (IO_CLASS_IDLE);
+  for (;;)
+    {
+      block_sector_t sector;
+
+      lock_acquire (&read_ahead_lock);
+      while (read_ahead_cnt == 0)
+        cond_wait (&read_ahead_cond, &read_ahead_lock);
+      sector = read_ahead_queue[read_ahead_head];
+      read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_SLOTS;
+      read_ahead_cnt--;
+      lock_release (&read_ahead_lock);
+
+      cache_put (cache_get (sector, true, IO_FS_DATA));
+    }
+}
@@ -0,0 +1,127 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/synch.h"
+
+/* The directory entry cache remembers recent name lookups, so
+   that repeated lookups of the same name in the same directory
+   do not have to read the directory from disk.  It is a
+   direct-mapped table: each (directory, name) pair can only live
+   in the slot it hashes to, and a newer pair simply replaces an
+   older one.
+
+   Entries are positive, mapping a name to the sector of its
+   inode, or negative, recording with DCACHE_ABSENT that the
+   directory has no such name.  Because a pair always hashes to
+   the same slot, recording a new fact about a name overwrites
+   any stale one.  Callers keep the cache consistent with the
+   disk by updating it while holding the directory's inode
+   lock. */
+
+/* Number of slots in the cache. */
+#define DCACHE_SIZE 128
+
+/* A cached directory entry. */
+struct dcache_entry
+  {
+    block_sector_t dir;                 /* Directory's inode sector. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    block_sector_t inode_sector;        /* Sector of NAME's inode. */
+    bool in_use;                        /* Does this slot hold an entry? */
+  };
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+static struct lock dcache_lock;         /* Protects dcache. */
+
+/* Statistics. */
+static unsigned long long lookup_cnt;   /* Calls to dcache_lookup(). */
+static unsigned long long hit_cnt;      /* Lookups answered. */
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  lock_init (&dcache_lock);
+}
+
+/* Returns the slot for NAME in directory DIR. */
+static struct dcache_entry *
+slot (block_sector_t dir, const char *name)
+{
+  return &dcache[(hash_string (name) ^ hash_int (dir)) % DCACHE_SIZE];
+}
+
+/* Returns true if E caches NAME in directory DIR. */
+static bool
+matches (const struct dcache_entry *e, block_sector_t dir, const char *name)
+{
+  return e->in_use && e->dir == dir && !strcmp (e->name, name);
+}
+
+/* Looks up NAME in directory DIR.  If it is cached, stores the
+   sector of its inode, or DCACHE_ABSENT if NAME is known not to
+   exist, in *INODE_SECTOR and returns true.  Otherwise returns
+   false. */
+bool
+dcache_lookup (block_sector_t dir, const char *name,
+               block_sector_t *inode_sector)
+{
+  struct dcache_entry *e = slot (dir, name);
+  bool found;
+
+  lock_acquire (&dcache_lock);
+  lookup_cnt++;
+  found = matches (e, dir, name);
+  if (found)
+    {
+      *inode_sector = e->inode_sector;
+      hit_cnt++;
+    }
+  lock_release (&dcache_lock);
+  return found;
+}
+
+/* Records that NAME in directory DIR has its inode in
+   INODE_SECTOR, or does not exist if INODE_SECTOR is
+   DCACHE_ABSENT.  Names too long to be valid are not cached. */
+void
+dcache_insert (block_sector_t dir, const char *name,
+               block_sector_t inode_sector)
+{
+  struct dcache_entry *e = slot (dir, name);
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  e->dir = dir;
+  strlcpy (e->name, name, sizeof e->name);
+  e->inode_sector = inode_sector;
+  e->in_use = true;
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every cached entry in directory DIR, which is being
+   deleted, so that none survives into a directory that later
+   reuses its sector. */
+void
+dcache_purge (block_sector_t dir)
+{
+  size_t i;
+
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    if (dcache[i].in_use && dcache[i].dir == dir)
+      dcache[i].in_use = false;
+  lock_release (&dcache_lock);
+}
+
+/* Prints directory entry cache statistics. */
+void
+dcache_print_stats (void)
+{
+  printf ("Dentry cache: %llu lookups, %llu hits\n", lookup_cnt, hit_cnt);
+}
@@ -1,7 +1,11 @@
 #include "filesys/directory.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -21,12 +25,107 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* A directory is a linear hash table.  It starts with a struct
+   dir_header sector, followed by pages of entries.  A name is
+   stored in the bucket selected by its hash, and each bucket is a
+   chain of pages: the bucket's own page, then any overflow pages
+   linked from it.  Bucket pages and overflow pages alternate in
+   the file, so that either kind can be added without moving the
+   other; the file is sparse, so the pages not yet used cost no
+   disk space.
+
+   Whenever an insertion has to start a new overflow page, one
+   bucket is split: bucket SPLIT's entries whose hash now selects
+   bucket BASE_CNT + SPLIT move to that new bucket, and SPLIT
+   advances, with BASE_CNT doubling when SPLIT reaches it.  A
+   split rewrites only the two chains involved and the header, so
+   the directory grows one bucket at a time, in a few sectors that
+   are journaled as part of the insertion, while the number of
+   buckets keeps pace with the number of entries.  Overflow pages
+   that a split empties are kept on a free list for reuse.
+
+   The header also records the directory's parent, for "..".  The
+   root is its own parent. */
+
+/* Identifies a directory header. */
+#define DIR_MAGIC 0x4449524c
+
+/* First sector of a directory. */
+struct dir_header
+  {
+    unsigned magic;                     /* DIR_MAGIC. */
+    uint32_t base_cnt;                  /* Buckets before this round. */
+    uint32_t split;                     /* Next bucket to split. */
+    uint32_t overflow_cnt;              /* Overflow pages ever used. */
+    uint32_t free_page;                 /* First free overflow page. */
+    block_sector_t parent;              /* Parent directory's sector. */
+  };
+
+/* Number of entries that fit in a page. */
+#define BUCKET_ENTRIES \
+  ((BLOCK_SECTOR_SIZE - sizeof (uint32_t)) / sizeof (struct dir_entry))
+
+/* A bucket page or overflow page of a directory.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_bucket
+  {
+    struct dir_entry entries[BUCKET_ENTRIES];
+    uint32_t next;                      /* Next page in chain, or 0. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - sizeof (uint32_t)
+                   - BUCKET_ENTRIES * sizeof (struct dir_entry)];
+  };
+
+/* Returns the page number of bucket B.  Bucket pages are the
+   even-numbered pages, so page 0, which is bucket 0's, is never
+   the next page in a chain. */
+static inline size_t
+bucket_page (size_t b)
+{
+  return 2 * b;
+}
+
+/* Returns the page number of overflow page K. */
+static inline size_t
+overflow_page (size_t k)
+{
+  return 2 * k + 1;
+}
+
+/* Returns the byte offset of page P within a directory. */
+static inline off_t
+page_ofs (size_t p)
+{
+  return (off_t) (p + 1) * BLOCK_SECTOR_SIZE;
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+   given SECTOR, whose parent is the directory in sector PARENT.
+   Returns true if successful, false on failure. */
 bool
-dir_create (block_sector_t sector, size_t entry_cnt)
+dir_create (block_sector_t sector, size_t entry_cnt, block_sector_t parent)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  struct dir_header header;
+  struct inode *inode;
+  bool success;
+
+  ASSERT (sizeof (struct dir_bucket) == BLOCK_SECTOR_SIZE);
+
+  header.magic = DIR_MAGIC;
+  header.base_cnt = entry_cnt > BUCKET_ENTRIES
+                    ? DIV_ROUND_UP (entry_cnt, BUCKET_ENTRIES) : 1;
+  header.split = 0;
+  header.overflow_cnt = 0;
+  header.free_page = 0;
+  header.parent = parent;
+  if (!inode_create (sector, page_ofs (bucket_page (header.base_cnt)), true))
+    return false;
+
+  inode = inode_open (sector);
+  success = (inode != NULL
+             && inode_write_at (inode, &header, sizeof header, 0)
+                == sizeof header);
+  inode_close (inode);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -83,32 +182,124 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Reads DIR's header into *HEADER.
+   Returns true if successful, false on failure. */
+static bool
+read_header (const struct dir *dir, struct dir_header *header)
+{
+  return (inode_read_at (dir->inode, header, sizeof *header, 0)
+          == sizeof *header
+          && header->magic == DIR_MAGIC);
+}
+
+/* Writes HEADER as DIR's header.
+   Returns true if successful, false on failure. */
+static bool
+write_header (struct dir *dir, const struct dir_header *header)
+{
+  return (inode_write_at (dir->inode, header, sizeof *header, 0)
+          == sizeof *header);
+}
+
+/* Returns the sector of DIR's parent directory.  The root is its
+   own parent. */
+block_sector_t
+dir_get_parent (const struct dir *dir)
+{
+  struct dir_header header;
+
+  return (read_header (dir, &header)
+          ? header.parent : inode_get_inumber (dir->inode));
+}
+
+/* Returns the bucket of the directory with the given HEADER that
+   NAME belongs in. */
+static size_t
+home_bucket (const struct dir_header *header, const char *name)
+{
+  unsigned hash = hash_string (name);
+  size_t b = hash % header->base_cnt;
+
+  /* Buckets before SPLIT have been split this round. */
+  if (b < header->split)
+    b = hash % (2 * header->base_cnt);
+  return b;
+}
+
+/* Reads page P of DIR into PAGE.
+   Returns true if successful, false on failure. */
+static bool
+read_page (const struct dir *dir, size_t p, struct dir_bucket *page)
+{
+  return (inode_read_at (dir->inode, page, sizeof *page, page_ofs (p))
+          == sizeof *page);
+}
+
+/* Writes PAGE to page P of DIR.
+   Returns true if successful, false on failure. */
+static bool
+write_page (struct dir *dir, size_t p, const struct dir_bucket *page)
+{
+  return (inode_write_at (dir->inode, page, sizeof *page, page_ofs (p))
+          == sizeof *page);
+}
+
+/* Sets the next page in the chain of page P of DIR to NEXT.
+   Returns true if successful, false on failure. */
+static bool
+write_next (struct dir *dir, size_t p, uint32_t next)
+{
+  return (inode_write_at (dir->inode, &next, sizeof next,
+                          page_ofs (p) + offsetof (struct dir_bucket, next))
+          == sizeof next);
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   Pages are read into the heap, to keep a sector off the kernel
+   stack. */
 static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
-  
+  struct dir_header header;
+  struct dir_bucket *page;
+  bool found = false;
+  size_t p, j;
+
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
-  return false;
+  if (!read_header (dir, &header))
+    return false;
+  page = malloc (sizeof *page);
+  if (page == NULL)
+    return false;
+
+  p = bucket_page (home_bucket (&header, name));
+  while (!found && read_page (dir, p, page))
+    {
+      for (j = 0; j < BUCKET_ENTRIES && !found; j++)
+        {
+          struct dir_entry *e = &page->entries[j];
+          if (e->in_use && !strcmp (name, e->name))
+            {
+              if (ep != NULL)
+                *ep = *e;
+              if (ofsp != NULL)
+                *ofsp = page_ofs (p) + j * sizeof *e;
+              found = true;
+            }
+        }
+      if (page->next == 0)
+        break;
+      p = page->next;
+    }
+  free (page);
+  return found;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -119,31 +310,250 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  block_sector_t dir_sector = inode_get_inumber (dir->inode);
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  *inode = NULL;
+  inode_lock (dir->inode);
+
+  /* A removed directory is empty, and must not put entries in
+     the cache under a sector that may be reused. */
+  if (inode_is_removed (dir->inode))
+    ;
+  else if (dcache_lookup (dir_sector, name, &e.inode_sector))
+    {
+      if (e.inode_sector != DCACHE_ABSENT)
+        *inode = inode_open (e.inode_sector);
+    }
+  else if (lookup (dir, name, &e, NULL))
+    {
+      dcache_insert (dir_sector, name, e.inode_sector);
+      *inode = inode_open (e.inode_sector);
+    }
   else
-    *inode = NULL;
+    dcache_insert (dir_sector, name, DCACHE_ABSENT);
+  inode_unlock (dir->inode);
 
   return *inode != NULL;
 }
 
+/* Takes an overflow page for DIR, whose header is HEADER, from
+   the free list or else from past the last one used, and stores
+   its number in *PAGEP.  Only HEADER is updated, in memory.
+   Returns true if successful, false on failure. */
+static bool
+take_page (const struct dir *dir, struct dir_header *header, size_t *pagep)
+{
+  uint32_t next;
+
+  if (header->free_page == 0)
+    {
+      *pagep = overflow_page (header->overflow_cnt++);
+      return true;
+    }
+  if (inode_read_at (dir->inode, &next, sizeof next,
+                     page_ofs (header->free_page)
+                     + offsetof (struct dir_bucket, next))
+      != sizeof next)
+    return false;
+  *pagep = header->free_page;
+  header->free_page = next;
+  return true;
+}
+
+/* Stores E in the first free slot in the chain of its bucket in
+   DIR, whose header is HEADER.  If every page of the chain is
+   full, adds a page to the end of the chain for E and sets *GREW
+   to true; HEADER is then updated in memory only.  PAGE is
+   scratch space.  Returns true if successful, false on failure. */
+static bool
+place_entry (struct dir *dir, struct dir_header *header,
+             const struct dir_entry *e, struct dir_bucket *page, bool *grew)
+{
+  size_t p = bucket_page (home_bucket (header, e->name));
+  size_t q, j;
+
+  *grew = false;
+  for (;;)
+    {
+      if (!read_page (dir, p, page))
+        return false;
+      for (j = 0; j < BUCKET_ENTRIES; j++)
+        if (!page->entries[j].in_use)
+          {
+            page->entries[j] = *e;
+            return write_page (dir, p, page);
+          }
+      if (page->next == 0)
+        break;
+      p = page->next;
+    }
+
+  /* Write the new page before linking it in, so that running out
+     of disk space leaves DIR intact. */
+  if (!take_page (dir, header, &q))
+    return false;
+  memset (page, 0, sizeof *page);
+  page->entries[0] = *e;
+  if (!write_page (dir, q, page) || !write_next (dir, p, q))
+    return false;
+  *grew = true;
+  return true;
+}
+
+/* Writes the CNT entries in ENTRIES to the chain of pages of DIR
+   listed in PAGES, filling each page in turn.  PAGE is scratch
+   space.  Returns true if successful, false on failure. */
+static bool
+write_chain (struct dir *dir, const size_t *pages,
+             const struct dir_entry *entries, size_t cnt,
+             struct dir_bucket *page)
+{
+  size_t page_cnt = cnt > 0 ? DIV_ROUND_UP (cnt, BUCKET_ENTRIES) : 1;
+  size_t i, j;
+
+  for (i = 0; i < page_cnt; i++)
+    {
+      memset (page, 0, sizeof *page);
+      for (j = 0; j < BUCKET_ENTRIES && i * BUCKET_ENTRIES + j < cnt; j++)
+        page->entries[j] = entries[i * BUCKET_ENTRIES + j];
+      page->next = i + 1 < page_cnt ? pages[i + 1] : 0;
+      if (!write_page (dir, pages[i], page))
+        return false;
+    }
+  return true;
+}
+
+/* Splits the next bucket of DIR, whose header is HEADER, moving
+   the entries whose hash selects the new bucket into it, and
+   writes the updated header.  Only the two buckets' chains and
+   the header are written.  PAGE is scratch space.
+   Returns true if successful, false on failure. */
+static bool
+split_bucket (struct dir *dir, struct dir_header *header,
+              struct dir_bucket *page)
+{
+  struct dir_header new_header = *header;
+  size_t old_b = header->split;
+  size_t new_b = header->base_cnt + header->split;
+  struct dir_entry *entries = NULL;
+  size_t *old_pages = NULL;
+  size_t *new_pages = NULL;
+  size_t entry_cnt = 0, stay_cnt = 0, page_cnt = 0;
+  size_t old_need, new_need, spare, fresh;
+  size_t p, i, j;
+  bool success = false;
+
+  /* Read the old bucket's chain. */
+  p = bucket_page (old_b);
+  for (;;)
+    {
+      size_t *pages;
+      struct dir_entry *more;
+
+      if (!read_page (dir, p, page))
+        goto done;
+      pages = realloc (old_pages, (page_cnt + 1) * sizeof *pages);
+      if (pages == NULL)
+        goto done;
+      old_pages = pages;
+      more = realloc (entries, ((page_cnt + 1) * BUCKET_ENTRIES
+                                * sizeof *entries));
+      if (more == NULL)
+        goto done;
+      entries = more;
+
+      old_pages[page_cnt++] = p;
+      for (j = 0; j < BUCKET_ENTRIES; j++)
+        if (page->entries[j].in_use)
+          entries[entry_cnt++] = page->entries[j];
+      if (page->next == 0)
+        break;
+      p = page->next;
+    }
+
+  /* Advance the split, then put the entries that stay in the old
+     bucket ahead of those that move. */
+  if (++new_header.split == new_header.base_cnt)
+    {
+      new_header.base_cnt *= 2;
+      new_header.split = 0;
+    }
+  for (i = 0; i < entry_cnt; i++)
+    if (home_bucket (&new_header, entries[i].name) == old_b)
+      {
+        struct dir_entry tmp = entries[i];
+        entries[i] = entries[stay_cnt];
+        entries[stay_cnt++] = tmp;
+      }
+
+  /* The new chain starts with the new bucket's page, then takes
+     any fresh overflow pages it needs, then the old chain's pages
+     that the old bucket no longer needs. */
+  old_need = stay_cnt > 0 ? DIV_ROUND_UP (stay_cnt, BUCKET_ENTRIES) : 1;
+  new_need = (entry_cnt - stay_cnt > 0
+              ? DIV_ROUND_UP (entry_cnt - stay_cnt, BUCKET_ENTRIES) : 1);
+  spare = page_cnt - old_need;
+  fresh = new_need - 1 > spare ? new_need - 1 - spare : 0;
+  new_pages = malloc (new_need * sizeof *new_pages);
+  if (new_pages == NULL)
+    goto done;
+  new_pages[0] = bucket_page (new_b);
+  for (i = 1; i < new_need; i++)
+    new_pages[i] = (i <= fresh
+                    ? overflow_page (new_header.overflow_cnt++)
+                    : old_pages[old_need + (i - 1 - fresh)]);
+
+  /* Only pages written for the first time can run out of disk
+     space, and the new chain puts those first, so a failure there
+     leaves DIR intact. */
+  if (!write_chain (dir, new_pages, entries + stay_cnt,
+                    entry_cnt - stay_cnt, page)
+      || !write_chain (dir, old_pages, entries, stay_cnt, page))
+    goto done;
+
+  /* Free the old chain's pages that neither chain uses. */
+  for (i = old_need + (new_need - 1 - fresh); i < page_cnt; i++)
+    {
+      memset (page, 0, sizeof *page);
+      page->next = new_header.free_page;
+      if (!write_page (dir, old_pages[i], page))
+        goto done;
+      new_header.free_page = old_pages[i];
+    }
+
+  if (write_header (dir, &new_header))
+    {
+      *header = new_header;
+      success = true;
+    }
+
+ done:
+  free (new_pages);
+  free (old_pages);
+  free (entries);
+  return success;
+}
+
 /* Adds a file named NAME to DIR, which must not already contain a
    file by that name.  The file's inode is in sector
-   INODE_SECTOR.
+   INODE_SECTOR.  An insertion that has to add a page to its
+   bucket's chain also splits a bucket.  The page is allocated
+   from the heap, to keep a sector off the kernel stack.
    Returns true if successful, false on failure.
    Fails if NAME is invalid (i.e. too long) or a disk or memory
    error occurs. */
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
+  struct dir_header header;
+  struct dir_bucket *page = NULL;
   struct dir_entry e;
-  off_t ofs;
   bool success = false;
+  bool grew;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
@@ -152,46 +562,95 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  inode_lock (dir->inode);
+
+  /* Check that DIR still exists and that NAME is not in use. */
+  if (inode_is_removed (dir->inode) || lookup (dir, name, NULL, NULL)
+      || !read_header (dir, &header))
+    goto done;
+  page = malloc (sizeof *page);
+  if (page == NULL)
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
-
-  /* Write slot. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+
+  /* A failed split leaves the buckets as they were, but the
+     header must still record the page the insertion took. */
+  success = place_entry (dir, &header, &e, page, &grew);
+  if (success && grew && !split_bucket (dir, &header, page))
+    success = write_header (dir, &header);
+  if (success)
+    dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
 
  done:
+  free (page);
+  inode_unlock (dir->inode);
   return success;
 }
 
+/* Reads the next in-use entry of DIR, as dir_readdir() does,
+   without locking DIR. */
+static bool
+next_entry (struct dir *dir, char name[NAME_MAX + 1])
+{
+  struct dir_entry e;
+
+  /* Every page, whether in a chain, free or not yet used, is read
+     in turn; the free and unused ones have no entries in use. */
+  for (;;)
+    {
+      /* Skip the header and the tail of each page. */
+      if (dir->pos < page_ofs (0))
+        dir->pos = page_ofs (0);
+      else if (dir->pos % BLOCK_SECTOR_SIZE
+               >= (off_t) (BUCKET_ENTRIES * sizeof e))
+        dir->pos = ROUND_UP (dir->pos, BLOCK_SECTOR_SIZE);
+
+      if (inode_read_at (dir->inode, &e, sizeof e, dir->pos) != sizeof e)
+        return false;
+      dir->pos += sizeof e;
+      if (e.in_use)
+        {
+          strlcpy (name, e.name, NAME_MAX + 1);
+          return true;
+        } 
+    }
+}
+
+/* Returns true if the directory in INODE has no entries.
+   The caller must hold INODE's lock. */
+static bool
+is_empty (struct inode *inode)
+{
+  struct dir dir;
+  char name[NAME_MAX + 1];
+
+  dir.inode = inode;
+  dir.pos = 0;
+  return !next_entry (&dir, name);
+}
+
 /* Removes any entry for NAME in DIR.
    Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   which occurs if there is no file with the given NAME or if
+   NAME is a directory that is not empty. */
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
+  block_sector_t dir_sector = inode_get_inumber (dir->inode);
   struct dir_entry e;
   struct inode *inode = NULL;
+  bool is_dir = false;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  inode_lock (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -201,16 +660,33 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
+  /* Only an empty directory may be removed.  Holding its lock
+     keeps entries from being added to it until it is marked
+     removed. */
+  is_dir = inode_is_dir (inode);
+  if (is_dir)
+    {
+      inode_lock (inode);
+      if (!is_empty (inode))
+        goto done;
+    }
+
   /* Erase directory entry. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  dcache_insert (dir_sector, name, DCACHE_ABSENT);
 
   /* Remove inode. */
   inode_remove (inode);
+  if (is_dir)
+    dcache_purge (e.inode_sector);
   success = true;
 
  done:
+  if (is_dir)
+    inode_unlock (inode);
+  inode_unlock (dir->inode);
   inode_close (inode);
   return success;
 }
@@ -221,16 +697,10 @@ dir_remove (struct dir *dir, const char *name)
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
-  struct dir_entry e;
+  bool success;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
-    {
-      dir->pos += sizeof e;
-      if (e.in_use)
-        {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
-        } 
-    }
-  return false;
+  inode_lock (dir->inode);
+  success = next_entry (dir, name);
+  inode_unlock (dir->inode);
+  return success;
 }
@@ -1,33 +1,54 @@
 #include "filesys/filesys.h"
 #include <debug.h>
+#include <list.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
 static void do_format (void);
+static void rebuild_free_map (void);
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
 void
 filesys_init (bool format) 
 {
+  block_sector_t journal;
+
   fs_device = block_get_role (BLOCK_FILESYS);
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
-  inode_init ();
   free_map_init ();
+  cache_init ();
+  inode_init ();
+  dcache_init ();
+  journal_init ();
 
   if (format) 
     do_format ();
 
-  free_map_open ();
+  /* Replay the journal, if there is one, before reading any other
+     metadata.  Even a journaled free map is rebuilt after an
+     unclean shutdown, to reclaim the sectors of files that were
+     removed while still open and of those whose release was
+     waiting for a checkpoint. */
+  journal = free_map_journal ();
+  if (journal != 0)
+    journal_open (journal);
+  if (!free_map_open ())
+    rebuild_free_map ();
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -36,8 +57,196 @@ void
 filesys_done (void) 
 {
   free_map_close ();
+  journal_done ();
+  cache_done ();
+}
+
+/* Writes all modified file system data and metadata to disk,
+   committing the journal's running transaction first. */
+void
+filesys_sync (void)
+{
+  journal_commit ();
+  cache_flush ();
 }
 
+/* Extracts a file name part from *SRCP into PART, and updates
+   *SRCP so that the next call will return the next file name
+   part.  Returns 1 if successful, 0 at end of string, -1 for a
+   too-long file name part. */
+static int
+get_next_part (char part[NAME_MAX + 1], const char **srcp)
+{
+  const char *src = *srcp;
+  char *dst = part;
+
+  /* Skip leading slashes.  If it's all slashes, we're done. */
+  while (*src == '/')
+    src++;
+  if (*src == '\0')
+    return 0;
+
+  /* Copy up to NAME_MAX characters from SRC to DST.  Add null
+     terminator. */
+  while (*src != '/' && *src != '\0')
+    {
+      if (dst < part + NAME_MAX)
+        *dst++ = *src;
+      else
+        return -1;
+      src++;
+    }
+  *dst = '\0';
+
+  /* Advance source pointer. */
+  *srcp = src;
+  return 1;
+}
+
+/* Opens the inode named NAME in DIR.  "." names DIR itself and
+   ".." its parent.  Returns a null pointer if there is no such
+   entry. */
+static struct inode *
+open_entry (struct dir *dir, const char *name)
+{
+  struct inode *inode = NULL;
+
+  if (!strcmp (name, "."))
+    inode = inode_reopen (dir_get_inode (dir));
+  else if (!strcmp (name, ".."))
+    inode = inode_open (dir_get_parent (dir));
+  else
+    dir_lookup (dir, name, &inode);
+  return inode;
+}
+
+/* Opens the directory named NAME in DIR, as open_entry() does.
+   Returns a null pointer if there is no such entry or if it is
+   not a directory. */
+static struct dir *
+open_subdir (struct dir *dir, const char *name)
+{
+  struct inode *inode = open_entry (dir, name);
+
+  if (inode != NULL && !inode_is_dir (inode))
+    {
+      inode_close (inode);
+      return NULL;
+    }
+  return dir_open (inode);
+}
+
+/* Resolves PATH, which is relative to the running thread's
+   working directory unless it starts with "/", and opens the
+   directory that contains its last component.  Stores the last
+   component in NAME, or "." if PATH names the root directory.
+   Returns the directory, which the caller must close, or a null
+   pointer if PATH is empty, has a component that is too long, or
+   passes through a directory that does not exist. */
+static struct dir *
+resolve (const char *path, char name[NAME_MAX + 1])
+{
+  struct dir *cwd = thread_current ()->cwd;
+  struct dir *dir;
+  char part[NAME_MAX + 1];
+  int result;
+
+  if (*path == '\0')
+    return NULL;
+
+  if (*path == '/' || cwd == NULL)
+    dir = dir_open_root ();
+  else
+    dir = dir_reopen (cwd);
+
+  /* Walk one component behind, so that NAME is left holding the
+     last one. */
+  name[0] = '\0';
+  while (dir != NULL && (result = get_next_part (part, &path)) != 0)
+    {
+      if (result < 0)
+        {
+          dir_close (dir);
+          return NULL;
+        }
+      if (name[0] != '\0')
+        {
+          struct dir *next = open_subdir (dir, name);
+          dir_close (dir);
+          dir = next;
+        }
+      strlcpy (name, part, NAME_MAX + 1);
+    }
+
+  if (name[0] == '\0')
+    strlcpy (name, ".", NAME_MAX + 1);
+  return dir;
+}
+
+/* Returns true if NAME is "." or "..", which cannot be created
+   or removed. */
+static bool
+is_dot_name (const char *name)
+{
+  return !strcmp (name, ".") || !strcmp (name, "..");
+}
+
+/* Releases the inode in SECTOR, which was created but could not
+   be linked into a directory, along with all of its data. */
+static void
+discard_inode (block_sector_t sector)
+{
+  struct inode *inode = inode_open (sector);
+
+  if (inode != NULL)
+    {
+      inode_remove (inode);
+      inode_close (inode);
+    }
+  else
+    free_map_release (sector, 1);
+}
+
+/* Creates a file, or a directory if IS_DIR is true, named NAME
+   with the given INITIAL_SIZE.  A directory's INITIAL_SIZE is its
+   initial number of entries.  Returns true if successful, false
+   otherwise. */
+static bool
+create (const char *name, off_t initial_size, bool is_dir)
+{
+  char part[NAME_MAX + 1];
+  block_sector_t inode_sector = 0;
+  struct dir *dir = resolve (name, part);
+  bool success = false;
+
+  journal_begin (JOURNAL_DIR_SECTORS);
+
+  /* Place the new inode near its directory's. */
+  if (dir != NULL && !is_dot_name (part)
+      && free_map_allocate_near (inode_get_inumber (dir_get_inode (dir)), 1,
+                                 &inode_sector))
+    {
+      bool created;
+
+      if (is_dir)
+        created = dir_create (inode_sector, initial_size,
+                              inode_get_inumber (dir_get_inode (dir)));
+      else
+        created = inode_create (inode_sector, initial_size, false);
+
+      if (!created)
+        free_map_release (inode_sector, 1);
+      else if (dir_add (dir, part, inode_sector))
+        success = true;
+      else
+        discard_inode (inode_sector);
+    }
+  dir_close (dir);
+
+  journal_end ();
+  return success;
+}
+
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
@@ -45,20 +254,21 @@ filesys_done (void)
 bool
 filesys_create (const char *name, off_t initial_size) 
 {
-  block_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
-                  && dir_add (dir, name, inode_sector));
-  if (!success && inode_sector != 0) 
-    free_map_release (inode_sector, 1);
-  dir_close (dir);
+  return create (name, initial_size, false);
+}
 
-  return success;
+/* Creates an empty directory named NAME.
+   Returns true if successful, false otherwise.
+   Fails if a file named NAME already exists, if a directory
+   along the way does not exist, or if internal memory allocation
+   fails. */
+bool
+filesys_mkdir (const char *name)
+{
+  return create (name, 0, true);
 }
 
-/* Opens the file with the given NAME.
+/* Opens the file or directory with the given NAME.
    Returns the new file if successful or a null pointer
    otherwise.
    Fails if no file named NAME exists,
@@ -66,38 +276,140 @@ filesys_create (const char *name, off_t initial_size)
 struct file *
 filesys_open (const char *name)
 {
-  struct dir *dir = dir_open_root ();
+  char part[NAME_MAX + 1];
+  struct dir *dir = resolve (name, part);
   struct inode *inode = NULL;
 
   if (dir != NULL)
-    dir_lookup (dir, name, &inode);
+    inode = open_entry (dir, part);
   dir_close (dir);
 
   return file_open (inode);
 }
 
-/* Deletes the file named NAME.
+/* Deletes the file or empty directory named NAME.
    Returns true if successful, false on failure.
-   Fails if no file named NAME exists,
-   or if an internal memory allocation fails. */
+   Fails if no file named NAME exists, if NAME is a directory
+   that is not empty, or if an internal memory allocation
+   fails. */
 bool
 filesys_remove (const char *name) 
 {
-  struct dir *dir = dir_open_root ();
-  bool success = dir != NULL && dir_remove (dir, name);
+  char part[NAME_MAX + 1];
+  struct dir *dir = resolve (name, part);
+  bool success;
+
+  journal_begin (JOURNAL_DIR_SECTORS);
+  success = dir != NULL && !is_dot_name (part) && dir_remove (dir, part);
   dir_close (dir); 
+  journal_end ();
 
   return success;
 }
 
+/* Changes the running thread's working directory to NAME.
+   Returns true if successful, false if NAME is not a
+   directory. */
+bool
+filesys_chdir (const char *name)
+{
+  struct thread *t = thread_current ();
+  char part[NAME_MAX + 1];
+  struct dir *dir = resolve (name, part);
+  struct dir *cwd = NULL;
+
+  if (dir != NULL)
+    cwd = open_subdir (dir, part);
+  dir_close (dir);
+  if (cwd == NULL)
+    return false;
+
+  dir_close (t->cwd);
+  t->cwd = cwd;
+  return true;
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
   printf ("Formatting file system...");
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  if (!dir_create (ROOT_DIR_SECTOR, 16, ROOT_DIR_SECTOR))
     PANIC ("root directory creation failed");
+  journal_create ();
   free_map_close ();
   printf ("done.\n");
 }
+
+/* A directory waiting to be visited by rebuild_free_map(). */
+struct pending_dir
+  {
+    block_sector_t sector;              /* Directory's inode sector. */
+    struct list_elem elem;              /* Element in pending list. */
+  };
+
+/* Rebuilds the free map from the inodes reachable from the root
+   directory and the journal's log, after an unclean shutdown may have left the free
+   map on disk out of date.  Sectors of files that were removed
+   while still open are reclaimed as well.  Directories are
+   visited from a list rather than recursively, so that deep
+   trees cannot overflow the kernel stack. */
+static void
+rebuild_free_map (void)
+{
+  struct list pending;
+  struct pending_dir *p;
+  struct inode *inode;
+
+  printf ("Rebuilding free map...");
+  free_map_reset ();
+
+  inode = inode_open (FREE_MAP_SECTOR);
+  if (inode == NULL)
+    PANIC ("can't open free map");
+  inode_reserve_sectors (inode);
+  inode_close (inode);
+  journal_reserve_sectors ();
+
+  list_init (&pending);
+  p = malloc (sizeof *p);
+  if (p == NULL)
+    PANIC ("out of memory rebuilding free map");
+  p->sector = ROOT_DIR_SECTOR;
+  list_push_back (&pending, &p->elem);
+
+  while (!list_empty (&pending))
+    {
+      char name[NAME_MAX + 1];
+      struct dir *dir;
+
+      p = list_entry (list_pop_front (&pending), struct pending_dir, elem);
+      dir = dir_open (inode_open (p->sector));
+      free (p);
+      if (dir == NULL)
+        PANIC ("can't open directory rebuilding free map");
+      inode_reserve_sectors (dir_get_inode (dir));
+
+      while (dir_readdir (dir, name))
+        {
+          if (!dir_lookup (dir, name, &inode))
+            continue;
+          if (inode_is_dir (inode))
+            {
+              p = malloc (sizeof *p);
+              if (p == NULL)
+                PANIC ("out of memory rebuilding free map");
+              p->sector = inode_get_inumber (inode);
+              list_push_back (&pending, &p->elem);
+            }
+          else
+            inode_reserve_sectors (inode);
+          inode_close (inode);
+        }
+      dir_close (dir);
+    }
+
+  filesys_sync ();
+  printf ("done.\n");
+}
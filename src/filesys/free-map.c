@@ -1,79 +1,385 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stddef.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* The free map is kept in memory and written back lazily: an
+   allocation or release only marks the sectors of the free map
+   file that hold the changed bits as dirty, and
+   free_map_flush() later writes just those sectors.
+
+   A crash can therefore leave a free map on disk that is out of
+   date.  To detect this, the free map file ends with a state
+   word that is set to FREE_MAP_IN_USE, and forced to disk, when
+   the file system is mounted, and set back to FREE_MAP_CLEAN only
+   after the whole free map has been written at shutdown.  A file
+   system found in use at mount was not shut down cleanly, so its
+   free map is rebuilt from the inodes reachable from the root
+   directory, which are authoritative.
+
+   For allocation the disk is divided into groups of GROUP_SIZE
+   sectors, and the number of free sectors in each group is kept
+   up to date.  An allocation starts at a hint, normally the
+   sector just past the file's last one or the inode of the
+   directory a new file goes into, and works outward group by
+   group, skipping groups that the counts show cannot hold the
+   request without looking at their bits.
+
+   After the state word comes the first sector of the metadata
+   journal, if the file system has one.  A journaled file system
+   is made consistent by replaying the journal, but its free map
+   is still rebuilt after an unclean shutdown, because the
+   journal does not record files that were removed while still
+   open, whose sectors are released only when they are closed.
+
+   A released sector that the journal may still replay an old
+   image of is not made available at once, but only after the
+   next checkpoint of the journal: until then, reusing it for
+   unjournaled file data could see the data overwritten by
+   replay.  Such sectors stay marked in use, in memory and on
+   disk, until then; if the machine stops first, they are
+   reclaimed when the free map is rebuilt at mount. */
+
+/* Number of sectors in an allocation group. */
+#define GROUP_SIZE 1024
+
+/* Values of the state word. */
+#define FREE_MAP_CLEAN  0x434c4e53      /* Written back at shutdown. */
+#define FREE_MAP_IN_USE 0x55534544      /* Mounted; may be stale. */
+
+/* Stored in the free map file just past the bitmap. */
+struct free_map_trailer
+  {
+    uint32_t state;                     /* FREE_MAP_CLEAN or _IN_USE. */
+    block_sector_t journal;             /* Journal sector, or 0. */
+  };
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty_map;     /* Free map file sectors to write. */
+static struct bitmap *deferred;      /* Released, awaiting checkpoint. */
+static size_t *group_free;           /* Free sectors in each group. */
+static size_t group_cnt;             /* Number of groups. */
+static struct lock free_map_lock;    /* Protects all of the above. */
+
+/* Returns the byte offset of the trailer in the free map file,
+   just past the bitmap. */
+static off_t
+state_ofs (void)
+{
+  return bitmap_file_size (free_map);
+}
+
+static void count_groups (void);
 
 /* Initializes the free map. */
 void
-free_map_init (void) 
+free_map_init (void)
 {
+  lock_init (&free_map_lock);
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                           BLOCK_SECTOR_SIZE));
+  deferred = bitmap_create (block_size (fs_device));
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SIZE);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (dirty_map == NULL || deferred == NULL || group_free == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  count_groups ();
+}
+
+/* Returns the sector just past the end of group G. */
+static size_t
+group_end (size_t g)
+{
+  size_t end = (g + 1) * GROUP_SIZE;
+  return end < bitmap_size (free_map) ? end : bitmap_size (free_map);
+}
+
+/* Recomputes the free sector count of every group from the free
+   map. */
+static void
+count_groups (void)
+{
+  size_t g;
+
+  for (g = 0; g < group_cnt; g++)
+    group_free[g] = bitmap_count (free_map, g * GROUP_SIZE,
+                                  group_end (g) - g * GROUP_SIZE, false);
+}
+
+/* Adjusts the group free counts for CNT sectors starting at
+   SECTOR, which have just been allocated if ALLOCATED is true or
+   freed otherwise. */
+static void
+count_sectors (block_sector_t sector, size_t cnt, bool allocated)
+{
+  while (cnt > 0)
+    {
+      size_t g = sector / GROUP_SIZE;
+      size_t n = group_end (g) - sector;
+      if (n > cnt)
+        n = cnt;
+      if (allocated)
+        group_free[g] -= n;
+      else
+        group_free[g] += n;
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Returns the first sector of a run of CNT free sectors that
+   starts in group G no earlier than sector FROM, or BITMAP_ERROR
+   if there is none.  The run may extend into later groups.  Each
+   bit is looked at once, keeping track of the free run that ends
+   at it, so the search takes time proportional to the group's
+   size plus CNT, not their product. */
+static size_t
+scan_group (size_t g, size_t from, size_t cnt)
+{
+  size_t avail = group_free[g];
+  size_t run = 0;
+  size_t i;
+
+  /* A run that starts in G and is no longer than a group lies
+     within G and the next group. */
+  if (cnt <= GROUP_SIZE && g + 1 < group_cnt)
+    avail += group_free[g + 1];
+  if (group_free[g] == 0 || (cnt <= GROUP_SIZE && avail < cnt))
+    return BITMAP_ERROR;
+
+  for (i = from; i - run < group_end (g) && i < bitmap_size (free_map); i++)
+    if (bitmap_test (free_map, i))
+      run = 0;
+    else if (++run == cnt)
+      return i + 1 - cnt;
+  return BITMAP_ERROR;
+}
+
+/* Marks the sectors of the free map file that hold the bits for
+   CNT sectors starting at SECTOR as needing to be written. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t bits_per_sector = BLOCK_SECTOR_SIZE * 8;
+  size_t first = sector / bits_per_sector;
+  size_t last = (sector + cnt - 1) / bits_per_sector;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Updates the free map, the group counts and the dirty sectors
+   for CNT sectors starting at SECTOR becoming ALLOCATED or
+   free. */
+static void
+set_sectors (block_sector_t sector, size_t cnt, bool allocated)
+{
+  ASSERT (allocated
+          ? bitmap_none (free_map, sector, cnt)
+          : bitmap_all (free_map, sector, cnt));
+  bitmap_set_multiple (free_map, sector, cnt, allocated);
+  count_sectors (sector, cnt, allocated);
+  mark_dirty (sector, cnt);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (0, cnt, sectorp);
+}
+
+/* Allocates CNT consecutive sectors from the free map, searching
+   first from HINT towards the end of the disk and then from the
+   start, and stores the first into *SECTORP.
+   Returns true if successful, false if not enough consecutive
+   sectors were available. */
+bool
+free_map_allocate_near (block_sector_t hint, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  size_t sector = BITMAP_ERROR;
+  size_t first, i;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  if (hint >= bitmap_size (free_map))
+    hint = 0;
+
+  /* Search HINT's group from HINT, then the following groups,
+     wrapping around, and finally the start of HINT's group. */
+  first = hint / GROUP_SIZE;
+  for (i = 0; i <= group_cnt && sector == BITMAP_ERROR; i++)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      size_t g = (first + i) % group_cnt;
+      sector = scan_group (g, i == 0 ? hint : g * GROUP_SIZE, cnt);
     }
+  if (sector != BITMAP_ERROR)
+    set_sectors (sector, cnt, true);
+  lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Makes CNT sectors starting at SECTOR available for use.  Those
+   the journal may replay become available only after the
+   journal's next checkpoint. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
-  ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  if (!journal_enabled ())
+    set_sectors (sector, cnt, false);
+  else
+    for (i = 0; i < cnt; i++)
+      if (journal_logged (sector + i))
+        bitmap_mark (deferred, sector + i);
+      else
+        set_sectors (sector + i, 1, false);
+  lock_release (&free_map_lock);
 }
 
-/* Opens the free map file and reads it from disk. */
+/* Makes the sectors whose release was deferred until the journal
+   could no longer replay them available for use.  Called by the
+   journal after a checkpoint. */
 void
-free_map_open (void) 
+free_map_checkpoint (void)
 {
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  size_t sector = 0;
+
+  lock_acquire (&free_map_lock);
+  while ((sector = bitmap_scan (deferred, sector, 1, true)) != BITMAP_ERROR)
+    {
+      bitmap_reset (deferred, sector);
+      set_sectors (sector, 1, false);
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Writes up to MAX of the dirty sectors of the free map file.
+   The writes go to the buffer cache, which carries them to disk.
+   Returns true if dirty sectors remain that MAX did not cover,
+   false if all of them were written. */
+bool
+free_map_flush (size_t max)
+{
+  size_t written = 0;
+  bool more = false;
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (i = 0; i < bitmap_size (dirty_map); i++)
+      if (bitmap_test (dirty_map, i))
+        {
+          if (written++ >= max)
+            {
+              more = true;
+              break;
+            }
+          if (bitmap_write_part (free_map, free_map_file,
+                                 i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+            bitmap_reset (dirty_map, i);
+        }
+  lock_release (&free_map_lock);
+  return more;
+}
+
+/* Writes STATE as the free map's state word and forces it, along
+   with everything written before it, to disk. */
+static void
+write_state (struct file *file, uint32_t state)
+{
+  if (file_write_at (file, &state, sizeof state,
+                     state_ofs () + offsetof (struct free_map_trailer, state))
+      != sizeof state)
+    PANIC ("can't write free map state");
+  cache_flush ();
+}
+
+/* Opens the free map file and reads it from disk.  Returns true
+   if the file system was shut down cleanly, false if the free
+   map may be stale and must be rebuilt with free_map_reset() and
+   free_map_reserve(). */
+bool
+free_map_open (void)
+{
+  struct file *file;
+  uint32_t state;
+  bool clean;
+
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
+  if (!bitmap_read (free_map, file))
     PANIC ("can't read free map");
+  lock_acquire (&free_map_lock);
+  count_groups ();
+  lock_release (&free_map_lock);
+
+  /* A free map without a state word comes from before the free
+     map was written lazily, when it was always up to date. */
+  clean = (file_read_at (file, &state, sizeof state,
+                         state_ofs () + offsetof (struct free_map_trailer,
+                                                  state))
+           != sizeof state
+           || state == FREE_MAP_CLEAN);
+  write_state (file, FREE_MAP_IN_USE);
+
+  lock_acquire (&free_map_lock);
+  free_map_file = file;
+  lock_release (&free_map_lock);
+  return clean;
 }
 
-/* Writes the free map to disk and closes the free map file. */
+/* Writes the free map to disk and closes the free map file.
+   Nothing more is allocated, so sectors whose release is still
+   deferred are released now: replay cannot harm a free sector.
+   Committing the journal writes the dirty free map sectors, in as
+   many transactions as they need. */
 void
-free_map_close (void) 
+free_map_close (void)
 {
+  free_map_checkpoint ();
+  journal_commit ();
+  cache_flush ();
+  write_state (free_map_file, FREE_MAP_CLEAN);
+
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
    it. */
 void
-free_map_create (void) 
+free_map_create (void)
 {
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
+  if (!inode_create (FREE_MAP_SECTOR,
+                     state_ofs () + sizeof (struct free_map_trailer), false))
     PANIC ("free map creation failed");
 
   /* Write bitmap to file. */
@@ -82,4 +388,65 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_map, false);
+}
+
+/* Records JOURNAL as the first sector of the file system's
+   journal.  Must be called while the file system is being
+   formatted. */
+void
+free_map_set_journal (block_sector_t journal)
+{
+  ASSERT (free_map_file != NULL);
+  if (file_write_at (free_map_file, &journal, sizeof journal,
+                     state_ofs () + offsetof (struct free_map_trailer,
+                                              journal))
+      != sizeof journal)
+    PANIC ("can't write journal location");
+}
+
+/* Returns the first sector of the file system's journal, or 0 if
+   it has none.  Called before the journal is replayed: the
+   location is written only when the file system is formatted, so
+   no image in the log can change it, and journal_open() discards
+   what this brings into the buffer cache. */
+block_sector_t
+free_map_journal (void)
+{
+  struct file *file;
+  block_sector_t journal;
+
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
+    PANIC ("can't open free map");
+  if (file_read_at (file, &journal, sizeof journal,
+                    state_ofs () + offsetof (struct free_map_trailer,
+                                             journal))
+      != sizeof journal)
+    journal = 0;
+  file_close (file);
+  return journal;
+}
+
+/* Marks every sector free, as the first step in rebuilding the
+   free map. */
+void
+free_map_reset (void)
+{
+  lock_acquire (&free_map_lock);
+  bitmap_set_all (free_map, false);
+  bitmap_set_all (dirty_map, true);
+  bitmap_set_all (deferred, false);
+  count_groups ();
+  lock_release (&free_map_lock);
+}
+
+/* Marks SECTOR as in use, while rebuilding the free map. */
+void
+free_map_reserve (block_sector_t sector)
+{
+  lock_acquire (&free_map_lock);
+  if (!bitmap_test (free_map, sector))
+    set_sectors (sector, 1, true);
+  lock_release (&free_map_lock);
 }
@@ -8,10 +8,20 @@
 void free_map_init (void);
 void free_map_read (void);
 void free_map_create (void);
-void free_map_open (void);
+bool free_map_open (void);
 void free_map_close (void);
+bool free_map_flush (size_t max);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (block_sector_t hint, size_t,
+                             block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+void free_map_checkpoint (void);
+
+void free_map_reset (void);
+void free_map_reserve (block_sector_t);
+
+void free_map_set_journal (block_sector_t);
+block_sector_t free_map_journal (void);
 
 #endif /* filesys/free-map.h */
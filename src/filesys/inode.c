@@ -1,23 +1,54 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
+#include <stdio.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of data sector pointers held directly in an inode. */
+#define DIRECT_CNT 120
+
+/* Number of sector pointers held in an indirect block. */
+#define PTRS_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof (block_sector_t))
+
+/* Number of data sectors reachable through each level of the
+   index, and in total. */
+#define INDIRECT_CNT PTRS_PER_SECTOR
+#define DOUBLY_INDIRECT_CNT (PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+#define MAX_SECTORS (DIRECT_CNT + INDIRECT_CNT + DOUBLY_INDIRECT_CNT)
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   Data sectors are found through DIRECT, then through the
+   pointers in the INDIRECT block, then through the indirect
+   blocks pointed to by the DOUBLY_INDIRECT block.  A pointer of
+   0 means that no sector has been allocated; sector 0 holds the
+   free map inode, so it is never a data sector.
+
+   Files are sparse.  Creating or extending a file only sets its
+   length, and a data sector (with any index blocks leading to
+   it) is allocated and zeroed when a write first touches it.
+   Until then its part of the file reads as zeros without any
+   disk access. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    block_sector_t direct[DIRECT_CNT];  /* Direct data sectors. */
+    block_sector_t indirect;            /* Indirect block. */
+    block_sector_t doubly_indirect;     /* Doubly indirect block. */
+    uint32_t is_dir;                    /* Nonzero for a directory. */
+    uint32_t unused[3];                 /* Not used. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,49 +59,256 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.
+
+   ELEM and OPEN_CNT are protected by open_inodes_lock.  LOCK
+   protects REMOVED, DENY_WRITE_CNT and changes to DATA.  Data
+   sectors below DATA.length never move, so reads do not need to
+   take LOCK. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    off_t read_ahead_ofs;               /* Where a sequential read resumes. */
+    struct lock lock;                   /* Protects the inode's metadata. */
+    struct lock op_lock;                /* See inode_lock(). */
     struct inode_disk data;             /* Inode content. */
   };
 
+/* Allocates a zeroed sector, preferably close to HINT, and
+   stores its number in *SECTORP.
+   Returns true if successful, false if the disk is full. */
+static bool
+allocate_sector (block_sector_t hint, block_sector_t *sectorp)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+
+  if (!free_map_allocate_near (hint, 1, sectorp))
+    return false;
+  cache_write (*sectorp, zeros);
+  return true;
+}
+
+/* Returns pointer IDX within indirect block BLOCK.  If the
+   pointer is 0 and ALLOCATE is true, first allocates a sector
+   near HINT and stores it in the pointer.
+   Returns 0 if no sector is (or could be) allocated. */
+static block_sector_t
+indirect_lookup (block_sector_t block, size_t idx, bool allocate,
+                 block_sector_t hint)
+{
+  block_sector_t sector;
+  int ofs = idx * sizeof sector;
+
+  ASSERT (idx < PTRS_PER_SECTOR);
+
+  cache_read_meta_at (block, &sector, ofs, sizeof sector);
+  if (sector == 0 && allocate && allocate_sector (hint, &sector))
+    cache_write_meta_at (block, &sector, ofs, sizeof sector);
+  return sector;
+}
+
+/* Returns the sector that holds data sector IDX of the file
+   described by DISK.  If ALLOCATE is true, allocates that
+   sector and any index blocks leading to it that are missing,
+   placing them near HINT.  DISK is updated in memory only; the
+   caller must write it back.
+   Returns 0 if no sector is (or could be) allocated. */
+static block_sector_t
+index_lookup (struct inode_disk *disk, size_t idx, bool allocate,
+              block_sector_t hint)
+{
+  block_sector_t block;
+
+  if (idx < DIRECT_CNT)
+    {
+      if (disk->direct[idx] == 0 && allocate)
+        allocate_sector (hint, &disk->direct[idx]);
+      return disk->direct[idx];
+    }
+  idx -= DIRECT_CNT;
+
+  if (idx < INDIRECT_CNT)
+    {
+      if (disk->indirect == 0
+          && (!allocate || !allocate_sector (hint, &disk->indirect)))
+        return 0;
+      return indirect_lookup (disk->indirect, idx, allocate, hint);
+    }
+  idx -= INDIRECT_CNT;
+
+  if (idx < DOUBLY_INDIRECT_CNT)
+    {
+      if (disk->doubly_indirect == 0
+          && (!allocate || !allocate_sector (hint, &disk->doubly_indirect)))
+        return 0;
+      block = indirect_lookup (disk->doubly_indirect, idx / PTRS_PER_SECTOR,
+                               allocate, hint);
+      if (block == 0)
+        return 0;
+      return indirect_lookup (block, idx % PTRS_PER_SECTOR, allocate, hint);
+    }
+
+  return 0;
+}
+
+/* A function applied to each sector of a file. */
+typedef void sector_func (block_sector_t);
+
+/* Calls FUNC on indirect block BLOCK and everything it points
+   to, the block itself last.  LEVEL is 1 for an indirect block,
+   2 for a doubly indirect block. */
+static void
+walk_indirect (block_sector_t block, int level, sector_func *func)
+{
+  size_t i;
+
+  for (i = 0; i < PTRS_PER_SECTOR; i++)
+    {
+      block_sector_t sector = indirect_lookup (block, i, false, 0);
+      if (sector == 0)
+        continue;
+      if (level > 1)
+        walk_indirect (sector, level - 1, func);
+      else
+        func (sector);
+    }
+  func (block);
+}
+
+/* Calls FUNC on every data and index sector of the file
+   described by DISK. */
+static void
+walk_sectors (struct inode_disk *disk, sector_func *func)
+{
+  size_t i;
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    if (disk->direct[i] != 0)
+      func (disk->direct[i]);
+  if (disk->indirect != 0)
+    walk_indirect (disk->indirect, 1, func);
+  if (disk->doubly_indirect != 0)
+    walk_indirect (disk->doubly_indirect, 2, func);
+}
+
+/* Returns SECTOR to the free map. */
+static void
+release_sector (block_sector_t sector)
+{
+  free_map_release (sector, 1);
+}
+
+/* Releases every data and index sector of the file described
+   by DISK. */
+static void
+release_sectors (struct inode_disk *disk)
+{
+  walk_sectors (disk, release_sector);
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
-   Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   Returns 0 if POS is in a hole or past the end of INODE. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
   ASSERT (inode != NULL);
   if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
+    return index_lookup (&inode->data, pos / BLOCK_SECTOR_SIZE, false, 0);
   else
-    return -1;
+    return 0;
+}
+
+/* Returns the sector that holds byte offset POS within INODE,
+   allocating it if it is in a hole or past the end of INODE.
+   A new sector is placed after the one before it in the file, or
+   after the inode for the first sector.
+   Returns 0 if POS is past the largest possible file or the disk
+   is full. */
+static block_sector_t
+byte_to_sector_alloc (struct inode *inode, off_t pos)
+{
+  size_t idx = pos / BLOCK_SECTOR_SIZE;
+  block_sector_t sector, hint;
+
+  sector = index_lookup (&inode->data, idx, false, 0);
+  if (sector != 0 || idx >= MAX_SECTORS)
+    return sector;
+
+  journal_begin (JOURNAL_ALLOC_SECTORS);
+  lock_acquire (&inode->lock);
+  hint = idx > 0 ? index_lookup (&inode->data, idx - 1, false, 0) : 0;
+  if (hint == 0)
+    hint = inode->sector;
+  sector = index_lookup (&inode->data, idx, true, hint + 1);
+  cache_write_meta (inode->sector, &inode->data);
+  lock_release (&inode->lock);
+  journal_end ();
+  return sector;
+}
+
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes, the open counts of its members, and the
+   statistics below. */
+static struct lock open_inodes_lock;
+
+/* Search key for open_inodes.  Kept out of the kernel stack
+   because of its size; protected by open_inodes_lock. */
+static struct inode open_inodes_key;
+
+/* Statistics. */
+static unsigned long long open_lookup_cnt;  /* Searches of open_inodes. */
+static unsigned long long open_hit_cnt;     /* Searches that found an inode. */
+
+/* Returns a hash value for the inode that contains E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Returns true if the inode that contains A precedes the one
+   that contains B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("open inode table creation failed");
+  lock_init (&open_inodes_lock);
 }
 
-/* Initializes an inode with LENGTH bytes of data and
+/* Prints statistics about the open inode table. */
+void
+inode_print_stats (void)
+{
+  printf ("Open inodes: %llu lookups, %llu hits\n",
+          open_lookup_cnt, open_hit_cnt);
+}
+
+/* Initializes an inode with LENGTH bytes of data, all zeros, and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  IS_DIR marks the inode as a directory.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails or LENGTH is too
+   large. */
 bool
-inode_create (block_sector_t sector, off_t length)
+inode_create (block_sector_t sector, off_t length, bool is_dir)
 {
   struct inode_disk *disk_inode = NULL;
   bool success = false;
@@ -81,63 +319,88 @@ inode_create (block_sector_t sector, off_t length)
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
 
+  if (bytes_to_sectors (length) > MAX_SECTORS)
+    return false;
+
+  /* The data sectors are allocated as they are written. */
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
-        {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true; 
-        } 
+      disk_inode->is_dir = is_dir;
+      cache_write_meta (sector, disk_inode);
+      success = true; 
       free (disk_inode);
     }
   return success;
 }
 
+/* Returns the open inode for SECTOR with its open count
+   incremented, or a null pointer if SECTOR is not open. */
+static struct inode *
+find_open_inode (block_sector_t sector)
+{
+  struct hash_elem *e;
+  struct inode *inode;
+
+  ASSERT (lock_held_by_current_thread (&open_inodes_lock));
+  open_lookup_cnt++;
+  open_inodes_key.sector = sector;
+  e = hash_find (&open_inodes, &open_inodes_key.elem);
+  if (e == NULL)
+    return NULL;
+
+  inode = hash_entry (e, struct inode, elem);
+  inode->open_cnt++;
+  open_hit_cnt++;
+  return inode;
+}
+
 /* Reads an inode from SECTOR
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
+  struct inode *open;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
-    }
+  lock_acquire (&open_inodes_lock);
+  open = find_open_inode (sector);
+  lock_release (&open_inodes_lock);
+  if (open != NULL)
+    return open;
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
     return NULL;
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The disk inode is read without holding
+     open_inodes_lock, so that other opens are not held up by
+     the disk. */
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  inode->read_ahead_ofs = 0;
+  lock_init (&inode->lock);
+  lock_init (&inode->op_lock);
+  cache_read_meta (inode->sector, &inode->data);
+
+  /* Another thread may have opened the inode in the meantime. */
+  lock_acquire (&open_inodes_lock);
+  open = find_open_inode (sector);
+  if (open == NULL)
+    hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+  if (open != NULL)
+    {
+      free (inode);
+      return open;
+    }
   return inode;
 }
 
@@ -146,7 +409,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -163,22 +430,28 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode) 
 {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
       /* Deallocate blocks if removed. */
       if (inode->removed) 
         {
+          journal_begin (JOURNAL_RELEASE_SECTORS);
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
+          release_sectors (&inode->data);
+          journal_end ();
         }
 
       free (inode); 
@@ -191,18 +464,75 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&inode->lock);
   inode->removed = true;
+  lock_release (&inode->lock);
+}
+
+/* Marks INODE's own sector and all of its data and index sectors
+   as in use in the free map, which is being rebuilt. */
+void
+inode_reserve_sectors (struct inode *inode)
+{
+  free_map_reserve (inode->sector);
+  walk_sectors (&inode->data, free_map_reserve);
+}
+
+/* Allocates every sector of the first SIZE bytes of INODE that
+   is still in a hole, so that later writes within them cannot
+   run out of disk space.  Returns true if successful, false if
+   the disk fills up, in which case some of the sectors may
+   already have been allocated. */
+bool
+inode_allocate (struct inode *inode, off_t size)
+{
+  off_t ofs;
+
+  for (ofs = 0; ofs < size; ofs += BLOCK_SECTOR_SIZE)
+    if (byte_to_sector_alloc (inode, ofs) == 0)
+      return false;
+  return true;
+}
+
+/* Returns true if INODE has been removed. */
+bool
+inode_is_removed (const struct inode *inode)
+{
+  return inode->removed;
+}
+
+/* Acquires INODE's operation lock, which callers hold across a
+   sequence of reads and writes of INODE that must appear atomic
+   to other threads, such as a directory lookup followed by an
+   insertion.  inode_read_at() and inode_write_at() do not take
+   it themselves. */
+void
+inode_lock (struct inode *inode)
+{
+  lock_acquire (&inode->op_lock);
+}
+
+/* Releases INODE's operation lock. */
+void
+inode_unlock (struct inode *inode)
+{
+  lock_release (&inode->op_lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
+   than SIZE if an error occurs or end of file is reached.
+   If the read continues where the previous one left off, the
+   following sector is read ahead in the background. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  bool sequential = offset == inode->read_ahead_ofs;
+
+  /* Directory contents and the free map are metadata. */
+  bool meta = inode_is_dir (inode) || inode->sector == FREE_MAP_SECTOR;
 
   while (size > 0) 
     {
@@ -220,99 +550,110 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      if (sector_idx != 0 && meta)
+        cache_read_meta_at (sector_idx, buffer + bytes_read, sector_ofs,
+                            chunk_size);
+      else if (sector_idx != 0)
+        cache_read_at (sector_idx, buffer + bytes_read, sector_ofs,
+                       chunk_size);
+      else
+        memset (buffer + bytes_read, 0, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+
+  inode->read_ahead_ofs = offset;
+  if (sequential && bytes_read > 0)
+    {
+      block_sector_t next = byte_to_sector (inode, offset);
+      if (next != 0)
+        cache_read_ahead (next);
+    }
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up or an error occurs.
+   Writing past end of file extends the inode.  Sectors are
+   allocated as they are first written, and the new length is
+   recorded once the data is in place. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
 
+  /* Directory contents and the free map are metadata. */
+  bool meta = inode_is_dir (inode) || inode->sector == FREE_MAP_SECTOR;
+
+  lock_acquire (&inode->lock);
   if (inode->deny_write_cnt)
-    return 0;
+    {
+      lock_release (&inode->lock);
+      return 0;
+    }
+  lock_release (&inode->lock);
 
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx = byte_to_sector_alloc (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Bytes left in sector, and number of bytes to actually
+         write into it. */
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
-
-      /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
+      int chunk_size = size < sector_left ? size : sector_left;
+      if (sector_idx == 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      if (meta)
+        cache_write_meta_at (sector_idx, buffer + bytes_written,
+                             sector_ofs, chunk_size);
+      else
+        cache_write_at (sector_idx, buffer + bytes_written,
+                        sector_ofs, chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  /* Extend the file if the write ended past its end, to the end
+     of the last chunk written.  A write that wrote nothing, for
+     example because the disk is full, leaves the length alone.
+     Only an extending write modifies the inode, so only it enters
+     the journal and may wait for a commit; the length is checked
+     again inside, since the journal must be entered before
+     INODE's lock is taken. */
+  if (bytes_written > 0)
+    {
+      bool extend;
+
+      lock_acquire (&inode->lock);
+      extend = offset > inode->data.length;
+      lock_release (&inode->lock);
+
+      if (extend)
+        {
+          journal_begin (JOURNAL_INODE_SECTORS);
+          lock_acquire (&inode->lock);
+          if (offset > inode->data.length)
+            {
+              inode->data.length = offset;
+              cache_write_meta (inode->sector, &inode->data);
+            }
+          lock_release (&inode->lock);
+          journal_end ();
+        }
+    }
 
   return bytes_written;
 }
@@ -322,8 +663,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  lock_acquire (&inode->lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&inode->lock);
 }
 
 /* Re-enables writes to INODE.
@@ -332,9 +675,11 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  lock_acquire (&inode->lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&inode->lock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -343,3 +688,10 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Returns true if INODE is a directory. */
+bool
+inode_is_dir (const struct inode *inode)
+{
+  return inode->data.is_dir != 0;
+}
@@ -0,0 +1,494 @@
+#include "filesys/journal.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* The journal makes each metadata update atomic and durable as a
+   unit: inode sectors, index blocks, directory contents and free
+   map bits.  File data is not journaled.
+
+   A file system operation runs between journal_begin() and
+   journal_end(), declaring up front the most sectors it may
+   modify, and writes metadata with cache_write_meta_at(),
+   which holds the modified cache entry and adds its sector to
+   the running transaction.  The transaction collects the updates
+   of many operations until it is committed: periodically by the
+   write-behind thread, when an operation's sectors would not fit
+   in it, or when the buffer cache runs short of entries that are
+   not held.  A commit waits
+   for the operations in progress to end, keeps new ones from
+   starting, and then writes a copy of every sector in the
+   transaction to the log, followed by a commit record.  Only
+   then are the cache entries released to be written back to
+   their home locations.
+
+   The free map sectors changed by the operations are brought
+   into the transaction only when it commits, and only those
+   sectors, as many as fit; the rest follow at once in further
+   transactions.  An operation does not count them in its
+   declaration.  The free map need not change atomically with the
+   operations, since after an unclean shutdown it is rebuilt
+   anyway.
+
+   Replay writes every logged image home, so a sector with an
+   image in the log must not be reused, for file data say, until
+   the log has been checkpointed past it.  The journal keeps track
+   of the sectors that it may replay, and the free map holds back
+   those that are released until the next checkpoint.
+
+   The log is a contiguous region of JOURNAL_SECTORS sectors.
+   Its first sector is a header giving the sequence number of the
+   first transaction in the log.  Each transaction follows the
+   previous one and consists of a descriptor sector, listing the
+   home sectors, then their contents, then a commit sector.  When
+   the log is nearly full, every committed sector is written home
+   and the log starts over with a new header.
+
+   At mount, journal_open() replays every complete transaction in
+   the log, in order, directly to disk.  A transaction whose commit
+   sector was not written is ignored, so after replay every
+   operation has either happened completely or not at all. */
+
+/* Maximum sectors in one transaction.  Held sectors stay in the
+   buffer cache, so this must leave some cache entries free for
+   file data. */
+#define TXN_MAX 48
+
+/* Identify the kinds of log sector. */
+#define HEADER_MAGIC 0x4a4e4c48         /* Log header. */
+#define DESC_MAGIC 0x4a4e4c44           /* Transaction descriptor. */
+#define COMMIT_MAGIC 0x4a4e4c43         /* Transaction commit record. */
+
+/* A log sector: the header, a descriptor or a commit record.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct log_sector
+  {
+    unsigned magic;                     /* One of the magics above. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Descriptor: number of sectors. */
+    block_sector_t sectors[TXN_MAX];    /* Descriptor: home sectors. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 3 * sizeof (uint32_t)
+                   - TXN_MAX * sizeof (block_sector_t)];
+  };
+
+static bool enabled;                    /* Is there a journal? */
+static block_sector_t log_start;        /* First sector of the log. */
+static block_sector_t log_pos;          /* Next log sector to write. */
+static uint32_t next_seq;               /* Sequence of next transaction. */
+
+/* The running transaction. */
+static block_sector_t txn[TXN_MAX];     /* Sectors modified. */
+static size_t txn_cnt;                  /* Number of sectors in txn. */
+static size_t reserved;                 /* Sectors operations may add. */
+static struct bitmap *logged;           /* Sectors replay could write. */
+
+static int active_cnt;                  /* Operations in progress. */
+static bool committing;                 /* Is a commit under way? */
+static struct thread *committer;        /* Thread running the commit. */
+static bool commit_requested;           /* Should the commit thread run? */
+static struct lock journal_lock;        /* Protects all of the above. */
+static struct condition journal_cond;   /* Signaled on changes. */
+
+static thread_func commit_thread NO_RETURN;
+
+/* Initializes the journal module.  The journal is not used until
+   journal_open() is called. */
+void
+journal_init (void)
+{
+  ASSERT (sizeof (struct log_sector) == BLOCK_SECTOR_SIZE);
+
+  lock_init (&journal_lock);
+  cond_init (&journal_cond);
+  enabled = false;
+  thread_create ("journal", PRI_DEFAULT, commit_thread, NULL);
+}
+
+/* Writes an empty log header with sequence number SEQ. */
+static void
+write_header (uint32_t seq)
+{
+  struct log_sector *header = calloc (1, sizeof *header);
+  enum io_purpose old;
+
+  if (header == NULL)
+    PANIC ("out of memory writing journal header");
+  header->magic = HEADER_MAGIC;
+  header->seq = seq;
+  old = block_set_purpose (IO_FS_META);
+  block_write (fs_device, log_start, header);
+  block_set_purpose (old);
+  free (header);
+}
+
+/* Allocates a log on a file system that is being formatted and
+   records its location in the free map. */
+void
+journal_create (void)
+{
+  if (!free_map_allocate (JOURNAL_SECTORS, &log_start))
+    PANIC ("no room for the journal");
+  write_header (1);
+  free_map_set_journal (log_start);
+}
+
+/* Replays the log that starts at sector START, then starts
+   journaling into it.  Must be called before any metadata other
+   than the journal's location is read; whatever the buffer cache
+   holds is discarded, before the replay and after it. */
+void
+journal_open (block_sector_t start)
+{
+  struct log_sector *log = malloc (sizeof *log);
+  uint8_t *data = malloc (BLOCK_SECTOR_SIZE);
+  block_sector_t pos = 1;
+  enum io_purpose old;
+  uint32_t seq;
+
+  if (log == NULL || data == NULL)
+    PANIC ("out of memory replaying journal");
+  logged = bitmap_create (block_size (fs_device));
+  if (logged == NULL)
+    PANIC ("out of memory opening journal");
+  log_start = start;
+  cache_invalidate ();
+  old = block_set_purpose (IO_FS_META);
+
+  block_read (fs_device, log_start, log);
+  if (log->magic != HEADER_MAGIC)
+    PANIC ("journal header is corrupt");
+  seq = log->seq;
+
+  /* Replay each complete transaction. */
+  for (;;)
+    {
+      size_t i, cnt;
+
+      block_read (fs_device, log_start + pos, log);
+      cnt = log->cnt;
+      if (log->magic != DESC_MAGIC || log->seq != seq
+          || cnt > TXN_MAX || pos + cnt + 2 > JOURNAL_SECTORS)
+        break;
+
+      block_read (fs_device, log_start + pos + cnt + 1, data);
+      if (((struct log_sector *) data)->magic != COMMIT_MAGIC
+          || ((struct log_sector *) data)->seq != seq)
+        break;
+
+      for (i = 0; i < cnt; i++)
+        {
+          block_read (fs_device, log_start + pos + 1 + i, data);
+          block_write (fs_device, log->sectors[i], data);
+        }
+      pos += cnt + 2;
+      seq++;
+    }
+  block_set_purpose (old);
+
+  /* Start a fresh log, whose sequence numbers the old records
+     cannot match, and forget anything cached from before the
+     replay. */
+  next_seq = seq;
+  write_header (next_seq);
+  log_pos = 1;
+  cache_invalidate ();
+  free (data);
+  free (log);
+
+  enabled = true;
+}
+
+/* Commits the running transaction, writes all metadata home, and
+   stops journaling. */
+void
+journal_done (void)
+{
+  journal_commit ();
+  if (enabled)
+    {
+      cache_flush ();
+      enabled = false;
+    }
+}
+
+/* Marks the log's sectors as in use in the free map, which is
+   being rebuilt. */
+void
+journal_reserve_sectors (void)
+{
+  block_sector_t i;
+
+  if (enabled)
+    for (i = 0; i < JOURNAL_SECTORS; i++)
+      free_map_reserve (log_start + i);
+}
+
+/* Returns true if metadata updates are being journaled. */
+bool
+journal_enabled (void)
+{
+  return enabled;
+}
+
+/* Starts an operation whose metadata updates must reach the disk
+   together, and which modifies at most SECTORS metadata sectors,
+   not counting free map sectors, which the commit brings in
+   separately.  Operations nest; only the outermost counts. */
+void
+journal_begin (size_t sectors)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (sectors <= TXN_MAX);
+  if (t->journal_depth++ > 0)
+    return;
+
+  /* The committing thread writes the free map through the file
+     system, which may begin an operation of its own. */
+  lock_acquire (&journal_lock);
+  while (committer != t
+         && (committing
+             || txn_cnt + reserved + sectors > TXN_MAX))
+    {
+      if (!committing)
+        {
+          commit_requested = true;
+          cond_broadcast (&journal_cond, &journal_lock);
+        }
+      cond_wait (&journal_cond, &journal_lock);
+    }
+  active_cnt++;
+  reserved += sectors;
+  t->journal_sectors = sectors;
+  lock_release (&journal_lock);
+}
+
+/* Ends an operation started with journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  reserved -= t->journal_sectors;
+  if (--active_cnt == 0)
+    cond_broadcast (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Records that SECTOR was modified by the running transaction.
+   Called by the buffer cache, which holds SECTOR's entry until
+   the transaction commits. */
+void
+journal_add (block_sector_t sector)
+{
+  size_t i;
+
+  lock_acquire (&journal_lock);
+  for (i = 0; i < txn_cnt; i++)
+    if (txn[i] == sector)
+      break;
+  if (i == txn_cnt)
+    {
+      ASSERT (txn_cnt < TXN_MAX);
+      txn[txn_cnt++] = sector;
+      bitmap_mark (logged, sector);
+    }
+  lock_release (&journal_lock);
+}
+
+/* Returns true if the log, or the running transaction, may hold
+   an image of SECTOR, which replay after a crash would write over
+   whatever SECTOR holds by then. */
+bool
+journal_logged (block_sector_t sector)
+{
+  bool is_logged;
+
+  if (!enabled)
+    return false;
+  lock_acquire (&journal_lock);
+  is_logged = bitmap_test (logged, sector);
+  lock_release (&journal_lock);
+  return is_logged;
+}
+
+/* Asks for the running transaction to be committed soon. */
+void
+journal_wake (void)
+{
+  if (!enabled)
+    return;
+  lock_acquire (&journal_lock);
+  commit_requested = true;
+  cond_broadcast (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Writes the CNT sectors in SECTORS to the log as transaction
+   SEQ, followed by its commit record.  The sector images are
+   written to the log in one transfer. */
+static void
+write_transaction (const block_sector_t *sectors, size_t cnt, uint32_t seq)
+{
+  struct log_sector *log = calloc (1, sizeof *log);
+  uint8_t *data = malloc (cnt * BLOCK_SECTOR_SIZE);
+  enum io_purpose old;
+  size_t i;
+
+  if (log == NULL || data == NULL)
+    PANIC ("out of memory committing journal");
+  old = block_set_purpose (IO_FS_META);
+
+  log->magic = DESC_MAGIC;
+  log->seq = seq;
+  log->cnt = cnt;
+  memcpy (log->sectors, sectors, cnt * sizeof *sectors);
+  block_write (fs_device, log_start + log_pos, log);
+
+  for (i = 0; i < cnt; i++)
+    cache_read_meta (sectors[i], data + i * BLOCK_SECTOR_SIZE);
+  block_write_multiple (fs_device, log_start + log_pos + 1, cnt, data);
+
+  memset (log, 0, sizeof *log);
+  log->magic = COMMIT_MAGIC;
+  log->seq = seq;
+  block_write (fs_device, log_start + log_pos + cnt + 1, log);
+  block_set_purpose (old);
+
+  log_pos += cnt + 2;
+  free (data);
+  free (log);
+}
+
+/* Writes the CNT sectors in SECTORS, taken from the running
+   transaction, to the log as the next transaction, lets them be
+   written home, and checkpoints the log if it is nearly full. */
+static void
+log_transaction (const block_sector_t *sectors, size_t cnt)
+{
+  size_t i, j;
+
+  write_transaction (sectors, cnt, next_seq++);
+
+  /* Release the committed sectors, except any modified again
+     since they were taken. */
+  lock_acquire (&journal_lock);
+  for (i = 0; i < cnt; i++)
+    {
+      for (j = 0; j < txn_cnt; j++)
+        if (txn[j] == sectors[i])
+          break;
+      if (j == txn_cnt)
+        cache_release (sectors[i]);
+    }
+  lock_release (&journal_lock);
+
+  /* Make sure the next transaction will fit by writing everything
+     committed so far home and starting the log over. */
+  if (log_pos + TXN_MAX + 2 > JOURNAL_SECTORS)
+    {
+      cache_flush ();
+      write_header (next_seq);
+      log_pos = 1;
+
+      /* Only the sectors modified again since the transaction was
+         taken can be replayed now, so the rest may be reused. */
+      lock_acquire (&journal_lock);
+      bitmap_set_all (logged, false);
+      for (i = 0; i < txn_cnt; i++)
+        bitmap_mark (logged, txn[i]);
+      lock_release (&journal_lock);
+      free_map_checkpoint ();
+    }
+}
+
+/* Commits the running transaction: waits for the operations in
+   progress to end, then writes the transaction to the log and
+   lets its sectors be written home.  Operations that begin in
+   the meantime wait for the commit to finish. */
+void
+journal_commit (void)
+{
+  enum io_class old_class = thread_current ()->io_class;
+  block_sector_t *sectors;
+  size_t cnt, room;
+  bool more;
+
+  /* New operations wait for the commit, checkpoint included, so
+     none of it is background work, even when the write-behind
+     thread starts it. */
+  if (old_class > IO_CLASS_INTERACTIVE)
+    block_set_class (IO_CLASS_INTERACTIVE);
+
+  lock_acquire (&journal_lock);
+  while (committing)
+    cond_wait (&journal_cond, &journal_lock);
+  committing = true;
+  committer = thread_current ();
+  commit_requested = false;
+  while (active_cnt > 0)
+    cond_wait (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+
+  sectors = malloc (TXN_MAX * sizeof *sectors);
+  if (sectors == NULL)
+    PANIC ("out of memory committing journal");
+  do
+    {
+      /* Bring the free map sectors changed by these operations
+         into the transaction, as many as fit.  The rest go into
+         the next one. */
+      lock_acquire (&journal_lock);
+      room = TXN_MAX - txn_cnt;
+      lock_release (&journal_lock);
+      more = free_map_flush (room);
+
+      /* Take the transaction.  Updates made from here on, outside
+         any operation, go into the next one. */
+      lock_acquire (&journal_lock);
+      cnt = txn_cnt;
+      memcpy (sectors, txn, cnt * sizeof *sectors);
+      txn_cnt = 0;
+      lock_release (&journal_lock);
+
+      if (enabled && cnt > 0)
+        log_transaction (sectors, cnt);
+    }
+  while (more);
+  free (sectors);
+
+  lock_acquire (&journal_lock);
+  committing = false;
+  committer = NULL;
+  cond_broadcast (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+  block_set_class (old_class);
+}
+
+/* Commits transactions as they are asked for, so that the
+   updates of concurrent operations are written to the log
+   together. */
+static void
+commit_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      lock_acquire (&journal_lock);
+      while (!commit_requested)
+        cond_wait (&journal_cond, &journal_lock);
+      lock_release (&journal_lock);
+
+      journal_commit ();
+    }
+}
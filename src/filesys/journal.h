@@ -0,0 +1,32 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Number of sectors in a journal, including its header. */
+#define JOURNAL_SECTORS 256
+
+/* Most metadata sectors, not counting free map sectors, modified
+   by each kind of operation, for journal_begin(). */
+#define JOURNAL_INODE_SECTORS 1         /* Updating a file's length. */
+#define JOURNAL_ALLOC_SECTORS 3         /* Allocating a file sector. */
+#define JOURNAL_RELEASE_SECTORS 0       /* Freeing a file's sectors. */
+#define JOURNAL_DIR_SECTORS 24          /* Changing a directory entry. */
+
+void journal_init (void);
+void journal_create (void);
+void journal_open (block_sector_t start);
+void journal_done (void);
+bool journal_enabled (void);
+void journal_reserve_sectors (void);
+
+void journal_begin (size_t sectors);
+void journal_end (void);
+void journal_add (block_sector_t);
+void journal_commit (void);
+void journal_wake (void);
+bool journal_logged (block_sector_t);
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,34 @@
+#ifndef __LIB_IOSTAT_H
+#define __LIB_IOSTAT_H
+
+/* Block device I/O statistics, kept by the kernel for each block
+   device and returned to user programs by iostat(). */
+
+/* What a block device request was made for. */
+enum io_purpose
+  {
+    IO_FS_DATA,                 /* File contents. */
+    IO_FS_META,                 /* Inodes, directories, free map, journal. */
+    IO_SWAP_IN,                 /* Reading a page back from swap. */
+    IO_SWAP_OUT,                /* Writing a page out to swap. */
+    IO_MMAP_WRITEBACK,          /* Writing a mapped page back to its file. */
+    IO_OTHER,                   /* Anything else. */
+    IO_PURPOSE_CNT
+  };
+
+/* Number of buckets in a latency histogram.  Bucket 0 counts
+   latencies under 1 microsecond and bucket I, for I > 0, those of
+   at least 2**(I-1) but under 2**I microseconds.  The last bucket
+   also counts anything longer. */
+#define IO_HIST_BUCKETS 24
+
+/* Statistics for one block device. */
+struct iostat
+  {
+    unsigned long long requests[IO_PURPOSE_CNT]; /* Requests completed. */
+    unsigned long long bytes[IO_PURPOSE_CNT];    /* Bytes transferred. */
+    unsigned long long wait[IO_HIST_BUCKETS];    /* Time spent queued. */
+    unsigned long long service[IO_HIST_BUCKETS]; /* Time being transferred. */
+  };
+
+#endif /* lib/iostat.h */
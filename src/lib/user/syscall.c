@@ -182,3 +182,9 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+iostat (const char *device, struct iostat *stats)
+{
+  return syscall2 (SYS_IOSTAT, device, stats);
+}
@@ -50,6 +50,7 @@ static bool yield_on_return;    /* Should we yield on interrupt return? */
 /* Programmable Interrupt Controller helpers. */
 static void pic_init (void);
 static void pic_end_of_interrupt (int irq);
+static bool pic_pending (int irq);
 
 /* Interrupt Descriptor Table helpers. */
 static uint64_t make_intr_gate (void (*) (void), int dpl);
@@ -224,6 +225,15 @@ intr_yield_on_return (void)
   ASSERT (intr_context ());
   yield_on_return = true;
 }
+
+/* Returns true if external interrupt VEC_NO has been raised but
+   not yet delivered, as happens while interrupts are off. */
+bool
+intr_ext_pending (uint8_t vec_no)
+{
+  ASSERT (vec_no >= 0x20 && vec_no <= 0x2f);
+  return pic_pending (vec_no);
+}
 
 /* 8259A Programmable Interrupt Controller. */
 
@@ -273,6 +283,19 @@ pic_end_of_interrupt (int irq)
   if (irq >= 0x28)
     outb (0xa0, 0x20);
 }
+
+/* Returns true if the given IRQ is set in its PIC's interrupt
+   request register, that is, raised but not yet acknowledged. */
+static bool
+pic_pending (int irq)
+{
+  uint16_t ctrl = irq < 0x28 ? PIC0_CTRL : PIC1_CTRL;
+
+  ASSERT (irq >= 0x20 && irq < 0x30);
+
+  outb (ctrl, 0x0a);      /* OCW3: read interrupt request register. */
+  return (inb (ctrl) >> (irq & 7)) & 1;
+}
 
 /* Creates a gate that invokes FUNCTION.
 
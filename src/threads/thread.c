@@ -477,6 +477,8 @@ init_thread (struct thread *t, const char *name, int priority)
   strlcpy (t->name, name, sizeof t->name);
   t->stack = (uint8_t *) t + PGSIZE;
   t->priority = priority;
+  t->io_purpose = IO_OTHER;
+  t->io_class = IO_CLASS_INTERACTIVE;
   t->magic = THREAD_MAGIC;
 
 #ifdef USERPROG
@@ -2,8 +2,10 @@
 #define THREADS_THREAD_H
 
 #include <debug.h>
+#include <iostat.h>
 #include <list.h>
 #include <stdint.h>
+#include "devices/block.h"
 #include "threads/synch.h"
 
 #ifdef USERPROG
@@ -31,6 +33,7 @@ struct fd_elem
   {
     int fd;                 /* File descriptor. */
     struct file *file;      /* The corresponding file pointer. */
+    struct dir *dir;        /* The directory, if fd names one. */
     struct list_elem elem;  /* Elem to create a list. */
   };
 
@@ -144,6 +147,18 @@ struct thread
     int next_mapid;                  /* An unused mapping ID. */
 #endif
 
+#ifdef FILESYS
+    /* Owned by filesys/filesys.c. */
+    struct dir *cwd;                     /* Working directory, or null for
+                                            the root directory. */
+    int journal_depth;                  /* Nesting of journal operations. */
+    size_t journal_sectors;             /* Sectors reserved in journal. */
+#endif
+
+    /* Owned by devices/block.c. */
+    enum io_purpose io_purpose;         /* Purpose of block requests. */
+    enum io_class io_class;             /* Priority class of block requests. */
+
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
   };
@@ -1,6 +1,7 @@
 #include "userprog/exception.h"
 #include <inttypes.h>
 #include <stdio.h>
+#include "devices/block.h"
 #include "userprog/gdt.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
@@ -146,6 +147,10 @@ page_fault (struct intr_frame *f)
   /* Count page faults. */
   page_fault_cnt++;
 
+  /* The faulting thread waits for any disk transfers needed to
+     resolve the fault, so give them the most urgent class. */
+  enum io_class old_class = block_set_class (IO_CLASS_FAULT);
+
   /* Determine cause. */
   not_present = (f->error_code & PF_P) == 0;
   write = (f->error_code & PF_W) != 0;
@@ -182,5 +187,7 @@ page_fault (struct intr_frame *f)
               user ? "user" : "kernel");
       kill (f);
     }
+
+  block_set_class (old_class);
 }
 
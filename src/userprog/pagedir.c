@@ -185,6 +185,24 @@ pagedir_set_dirty (uint32_t *pd, const void *vpage, bool dirty)
     }
 }
 
+/* Clears the accessed bit in the PTE for virtual page VPAGE in
+   PD and returns whether it was set.  Unlike
+   pagedir_set_accessed(), this flushes only VPAGE's entry from
+   the TLB rather than the whole TLB, and only if the bit was set
+   and PD is active. */
+bool
+pagedir_test_and_clear_accessed (uint32_t *pd, const void *vpage)
+{
+  uint32_t *pte = lookup_page (pd, vpage, false);
+  if (pte == NULL || (*pte & PTE_A) == 0)
+    return false;
+
+  *pte &= ~(uint32_t) PTE_A;
+  if (active_pd () == pd)
+    asm volatile ("invlpg (%0)" : : "r" (vpage) : "memory");
+  return true;
+}
+
 /* Returns true if the PTE for virtual page VPAGE in PD has been
    accessed recently, that is, between the time the PTE was
    installed and the last time it was cleared.  Returns false if
@@ -57,6 +57,14 @@ parent_or_child_exited (struct user_elem *u)
     free (u);
 }
 
+/* What process_execute() passes to start_process(). */
+struct start_info
+  {
+    char **argv;                /* Argument vector, on the parent's stack. */
+    struct user_elem *u;        /* Shared with the parent. */
+    struct dir *cwd;            /* Working directory, or null for root. */
+  };
+
 static thread_func start_process NO_RETURN;
 static bool load (const char *cmdline, void (**eip) (void), void **esp);
 
@@ -149,15 +157,22 @@ process_execute (const char *file_name)
     }
 
   list_push_back (&thread_current ()->children, &u->elem);
-  struct pair p;
-  p.first = argv;
-  p.second = u;
-
-  /* Create a new thread to execute FILE_NAME, passing arguments from array and 
-     user_elem u as a pair to aux */
-  tid = thread_create (argv[0], PRI_DEFAULT, start_process, &p);
+  struct start_info info;
+  info.argv = argv;
+  info.u = u;
+
+  /* The child starts out in its parent's working directory. Other kernel
+     threads have none of their own. */
+  info.cwd = NULL;
+  if (thread_current ()->cwd != NULL)
+    info.cwd = dir_reopen (thread_current ()->cwd);
+
+  /* Create a new thread to execute FILE_NAME, passing arguments from array,
+     user_elem u and the working directory to aux */
+  tid = thread_create (argv[0], PRI_DEFAULT, start_process, &info);
   if (tid == TID_ERROR)
     {
+      dir_close (info.cwd);
       palloc_free_page (fn_copy);
       return TID_ERROR;
     }
@@ -224,10 +239,11 @@ user_stack_set_up (char **argv, struct intr_frame *intrf)
 static void
 start_process (void *command_information)
 {
-  /* command_information stores a pair. */
-  char **argv = ((struct pair *) command_information)->first;
-  thread_current ()->user_elem = ((struct pair *) command_information)->second;
+  struct start_info *info = command_information;
+  char **argv = info->argv;
+  thread_current ()->user_elem = info->u;
   thread_current ()->user_elem->tid = thread_current ()->tid;
+  thread_current ()->cwd = info->cwd;
 
   /* Initialize the supplemental page table. */
   supplemental_page_table_init (&thread_current ()->supplemental_page_table);
@@ -346,16 +362,19 @@ process_exit (void)
   parent_or_child_exited (cur->user_elem);
 
   /* Closing any open files. */
-  filesys_acquire ();
   while (!list_empty (&cur->fds))
     {
       struct list_elem *elem = list_begin (&cur->fds);
       struct fd_elem *fd_elem = list_entry (elem, struct fd_elem, elem);
       file_close (fd_elem->file);
+      dir_close (fd_elem->dir);
       list_remove (elem);
       free (fd_elem);
     }
-  filesys_release ();
+
+  /* Leaving the working directory. */
+  dir_close (cur->cwd);
+  cur->cwd = NULL;
 
   /* Unmapping any mapped files. */
   while (!list_empty (&cur->mapids))
@@ -371,9 +390,7 @@ process_exit (void)
   supplemental_page_table_destroy (&cur->supplemental_page_table);
 
   /* Closing the rox opened on load. */
-  filesys_acquire ();
   file_close (cur->loaded_file);
-  filesys_release ();
 
   uint32_t *pd;
 
@@ -501,7 +518,6 @@ load (const char *file_name, void (**eip) (void), void **esp)
   process_activate ();
 
   /* Open executable file. */
-  filesys_acquire ();
   file = filesys_open (file_name);
   if (file == NULL)
     {
@@ -590,7 +606,6 @@ load (const char *file_name, void (**eip) (void), void **esp)
   thread_current ()->loaded_file = file;
 
 done:
-  filesys_release ();
   /* We arrive here whether the load is successful or not. */  
   return success;
 }
@@ -4,13 +4,6 @@
 #include "threads/thread.h"
 #include "threads/synch.h"
 
-/* A struct to store a pair. */
-struct pair
-  {
-    void *first;
-    void *second;
-  };
-
 tid_t process_execute (const char *file_name);
 int process_wait (tid_t);
 void process_exit (void);
@@ -1,5 +1,6 @@
 #include "syscall.h"
 #include <stdio.h>
+#include <string.h>
 #include <syscall-nr.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
@@ -10,34 +11,14 @@
 #include "threads/vaddr.h"
 #include "devices/shutdown.h"
 #include "devices/input.h"
+#include "devices/block.h"
 #include "pagedir.h"
+#include "filesys/directory.h"
 #include "filesys/filesys.h"
 #include "filesys/file.h"
+#include "filesys/inode.h"
 #include "vm/page.h"
 
-static struct lock filesys_lock;      /* Lock for the filesystem. */
-static int filesys_lock_depth;        /* How many times it has been acquired. */
-
-/* Acquire the lock for the filesystem. */
-void
-filesys_acquire (void)
-{
-  if (lock_held_by_current_thread (&filesys_lock))
-    filesys_lock_depth++;
-  else
-    lock_acquire (&filesys_lock);
-}
-
-/* Releases the lock for the filesystem. */
-void
-filesys_release (void)
-{
-  if (filesys_lock_depth > 0)
-    filesys_lock_depth--;
-  else
-    lock_release (&filesys_lock);
-}
-
 /* Validates user pointer */
 static void
 validate_user_pointer (const void *p)
@@ -106,10 +87,10 @@ validate_user_string (const char *string)
   exit_util (KILLED);
 }
 
-/* Returns a file pointer from a file descriptor, or null if file descriptor is 
+/* Returns the fd_elem for a file descriptor, or null if file descriptor is 
    invalid. */
-static struct file *
-file_from_fd (int fd)
+static struct fd_elem *
+fd_elem_from_fd (int fd)
 {
   /* Iterate through thread's fds and find the correct one. */
   struct thread *t = thread_current ();
@@ -119,13 +100,31 @@ file_from_fd (int fd)
     {
       struct fd_elem *fd_elem = list_entry (elem, struct fd_elem, elem);
       if (fd_elem->fd == fd)
-        return fd_elem->file;
+        return fd_elem;
     }
   
   /* Incorrect fd has been passed. */
   return NULL;
 }
 
+/* Returns a file pointer from a file descriptor, or null if file descriptor is 
+   invalid or names a directory. */
+static struct file *
+file_from_fd (int fd)
+{
+  struct fd_elem *fd_elem = fd_elem_from_fd (fd);
+  return fd_elem != NULL ? fd_elem->file : NULL;
+}
+
+/* Returns a directory from a file descriptor, or null if file descriptor is 
+   invalid or names an ordinary file. */
+static struct dir *
+dir_from_fd (int fd)
+{
+  struct fd_elem *fd_elem = fd_elem_from_fd (fd);
+  return fd_elem != NULL ? fd_elem->dir : NULL;
+}
+
 /* Get the n th argument from an interrupt frame. */
 static int32_t *
 get_arg (const struct intr_frame *f, int n)
@@ -189,9 +188,7 @@ create_h (struct intr_frame *f)
   unsigned initial_size = *get_arg (f, 2);
   validate_user_string (name);
 
-  filesys_acquire ();
   f->eax = filesys_create (name, initial_size);
-  filesys_release ();
 }
 
 /* Deletes the file of the given name. Returns true if successful, false 
@@ -202,9 +199,7 @@ remove_h (struct intr_frame *f)
   const char *name = *(char **) get_arg (f, 1);
   validate_user_string (name);
 
-  filesys_acquire ();
   f->eax = filesys_remove (name);
-  filesys_release();
 }
 
 /* Opens the file whose name is passed on the interrupt frame. Returns a 
@@ -216,9 +211,7 @@ open_h (struct intr_frame *f)
   const char *name = *(char **) get_arg (f, 1);
   validate_user_string (name);
 
-  filesys_acquire ();
   struct file *file = filesys_open (name);
-  filesys_release ();
 
   if (file == NULL)
     {
@@ -239,6 +232,22 @@ open_h (struct intr_frame *f)
 
   fd->fd = thread_current ()->next_fd;
   fd->file = file;
+  fd->dir = NULL;
+
+  /* Directories are read with readdir, not read, so they are kept as a dir. */
+  if (inode_is_dir (file_get_inode (file)))
+    {
+      fd->dir = dir_open (inode_reopen (file_get_inode (file)));
+      file_close (file);
+      fd->file = NULL;
+      if (fd->dir == NULL)
+        {
+          free (fd);
+          f->eax = -1;
+          return;
+        }
+    }
+
   list_push_back (&thread_current ()->fds, &fd->elem);
   f->eax = thread_current ()->next_fd++;
 }
@@ -258,9 +267,7 @@ filesize_h (struct intr_frame *f)
       return;
     }
 
-  filesys_acquire ();
   f->eax = file_length (file);
-  filesys_release ();
 }
 
 /* Reads size bytes from the file open as the given file descriptor into buffer.   
@@ -289,9 +296,7 @@ read_h (struct intr_frame *f)
       if (file == NULL)
         return;
 
-      filesys_acquire ();
       f->eax = file_read (file, buffer, size);
-      filesys_release (); 
     }
 }
 
@@ -321,9 +326,7 @@ write_h (struct intr_frame *f)
       if (file == NULL)
         return;
       
-      filesys_acquire ();
       f->eax = file_write (file, buffer, size);
-      filesys_release ();
     }
 }
 
@@ -337,9 +340,7 @@ seek_h (struct intr_frame *f)
   if (file == NULL)
     return;
 
-  filesys_acquire ();
   file_seek (file, position);
-  filesys_release ();
 }
 
 /* Returns the next byte to read or write in an open file fd. Returns -1 if the 
@@ -353,9 +354,7 @@ tell_h (struct intr_frame *f)
   if (file == NULL)
     return;
 
-  filesys_acquire ();
   f->eax = file_tell (file);
-  filesys_release ();
 }
 
 /* Closes file descriptor fd. */
@@ -365,9 +364,8 @@ close_h (struct intr_frame *f)
   int fd = *get_arg (f, 1);
   struct file *file = file_from_fd (fd);
 
-  filesys_acquire ();
   file_close (file);
-  filesys_release ();
+  dir_close (dir_from_fd (fd));
 
   /* Removing fd from the thread's list of open fds. */
   for (struct list_elem *elem = list_begin (&thread_current ()->fds);
@@ -399,9 +397,7 @@ mmap_h (struct intr_frame *f)
   struct file *file = file_from_fd (fd);
   f->eax = -1; /* Setting the default return value. */
 
-  filesys_acquire ();
   int size = file == NULL ? 0 : file_length (file);
-  filesys_release ();
 
   /* Checking that all the covered addresses are valid user addresses and not 
      saved for the stack. Note that only checking the last address is sufficient
@@ -429,11 +425,22 @@ mmap_h (struct intr_frame *f)
     return;
 
   /* Reopening the file. */
-  filesys_acquire ();
   file = file_reopen (file);
-  filesys_release ();
   if (file == NULL)
-    return;
+    {
+      free (mapid);
+      return;
+    }
+
+  /* Allocating the sectors of any holes in the file now, so that
+     writing the pages back, on eviction or munmap, cannot fail for
+     lack of disk space. */
+  if (!inode_allocate (file_get_inode (file), size))
+    {
+      file_close (file);
+      free (mapid);
+      return;
+    }
 
   /* Add the required pages to the supplemental page table. */
   int ofs = 0;
@@ -472,8 +479,6 @@ munmap_util (struct mapid_elem *mapid)
 {
   struct thread *t = thread_current ();
 
-  filesys_acquire ();
-
   /* Iterate through all the covered pages. */
   for (void *page = mapid->addr; page < mapid->addr + mapid->size; 
        page += PGSIZE)
@@ -482,12 +487,18 @@ munmap_util (struct mapid_elem *mapid)
           get_page_elem (&t->supplemental_page_table, page);
       ASSERT (page_elem != NULL);
 
-      /* Write back to file if dirty bit is set. */
-      void *kpage = pagedir_get_page (t->pagedir, page);
-      if (pagedir_is_dirty (t->pagedir, page))
+      /* Write back to file if dirty bit is set. The frame is pinned first
+         so that it is not evicted, and written back, from under us. */
+      if (page_elem->frame_elem != NULL && frame_pin (page_elem->frame_elem)
+          && pagedir_is_dirty (t->pagedir, page))
         {
-          file_seek (mapid->file, page_elem->offset);
-          file_write (mapid->file, kpage, page_elem->bytes_read);
+          enum io_purpose old = block_set_purpose (IO_MMAP_WRITEBACK);
+          off_t written = file_write_at (mapid->file,
+                                         page_elem->frame_elem->frame,
+                                         page_elem->bytes_read,
+                                         page_elem->offset);
+          block_set_purpose (old);
+          ASSERT (written == (off_t) page_elem->bytes_read);
         }
 
       /* Clear page directory and remove page from SPT. */
@@ -496,7 +507,6 @@ munmap_util (struct mapid_elem *mapid)
     }
 
   file_close (mapid->file);
-  filesys_release ();
 }
 
 /* Unmaps a file from virtual memory. */
@@ -532,10 +542,107 @@ munmap_h (struct intr_frame *f)
   free (mapid);
 }
 
+/* Changes the current working directory of the process to dir, which may be 
+   relative or absolute. Returns true if successful, false on failure. */
+static void
+chdir_h (struct intr_frame *f)
+{
+  const char *dir = *(char **) get_arg (f, 1);
+  validate_user_string (dir);
+
+  f->eax = filesys_chdir (dir);
+}
+
+/* Creates the directory named dir, which may be relative or absolute. Returns 
+   true if successful, false on failure. */
+static void
+mkdir_h (struct intr_frame *f)
+{
+  const char *dir = *(char **) get_arg (f, 1);
+  validate_user_string (dir);
+
+  f->eax = filesys_mkdir (dir);
+}
+
+/* Reads a directory entry from file descriptor fd, which must represent a 
+   directory, into name. Returns true if successful, false if there are no more 
+   entries or fd is not a directory. "." and ".." are never returned. */
+static void
+readdir_h (struct intr_frame *f)
+{
+  int fd = *get_arg (f, 1);
+  char *name = *(char **) get_arg (f, 2);
+  validate_user_buffer (name, READDIR_MAX_LEN + 1);
+  f->eax = false; /* Setting the default return value. */
+
+  struct dir *dir = dir_from_fd (fd);
+  if (dir == NULL)
+    return;
+
+  /* Read into a kernel buffer so that no page fault is taken while the 
+     directory is locked. */
+  char entry[NAME_MAX + 1];
+  if (dir_readdir (dir, entry))
+    {
+      memcpy (name, entry, strlen (entry) + 1);
+      f->eax = true;
+    }
+}
+
+/* Returns true if fd represents a directory, false if it represents an 
+   ordinary file. */
+static void
+isdir_h (struct intr_frame *f)
+{
+  int fd = *get_arg (f, 1);
+
+  f->eax = dir_from_fd (fd) != NULL;
+}
+
+/* Returns the inode number of the inode associated with fd, which may 
+   represent an ordinary file or a directory, or -1 if fd is invalid. */
+static void
+inumber_h (struct intr_frame *f)
+{
+  int fd = *get_arg (f, 1);
+  struct fd_elem *fd_elem = fd_elem_from_fd (fd);
+  f->eax = -1; /* Setting the default return value. */
+  if (fd_elem == NULL)
+    return;
+
+  struct inode *inode = fd_elem->dir != NULL 
+                        ? dir_get_inode (fd_elem->dir) 
+                        : file_get_inode (fd_elem->file);
+  f->eax = inode_get_inumber (inode);
+}
+
+/* Stores the I/O statistics of the block device named device in stats. 
+   Returns true if successful, false if there is no such device. */
+static void
+iostat_h (struct intr_frame *f)
+{
+  const char *device = *(char **) get_arg (f, 1);
+  struct iostat *stats = *(struct iostat **) get_arg (f, 2);
+  validate_user_string (device);
+  validate_user_buffer (stats, sizeof *stats);
+  f->eax = false; /* Setting the default return value. */
+
+  struct block *block = block_get_by_name (device);
+  if (block == NULL)
+    return;
+
+  /* Copy through a kernel buffer, because block_get_stats() holds a lock 
+     that servicing a page fault on the user's buffer may need. */
+  struct iostat copy;
+  block_get_stats (block, &copy);
+  memcpy (stats, &copy, sizeof copy);
+  f->eax = true;
+}
+
 /* sys_func represents a system call function called by syscall_handler. */
 typedef void sys_func (struct intr_frame *);
 
-#define NUM_SYSCALLS 15
+#define NUM_SYSCALLS 21
 
 /* Array mapping sys_func to the corresponsing system call numbers. */
 static sys_func *sys_funcs[NUM_SYSCALLS] = {
@@ -553,7 +660,13 @@ static sys_func *sys_funcs[NUM_SYSCALLS] = {
   tell_h,
   close_h,
   mmap_h,
-  munmap_h
+  munmap_h,
+  chdir_h,
+  mkdir_h,
+  readdir_h,
+  isdir_h,
+  inumber_h,
+  iostat_h
 };
 
 static void syscall_handler (struct intr_frame *);
@@ -561,7 +674,6 @@ static void syscall_handler (struct intr_frame *);
 void
 syscall_init (void) 
 {
-  lock_init (&filesys_lock);
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
@@ -8,8 +8,6 @@
 
 void syscall_init (void);
 void exit_util (int) NO_RETURN;
-void filesys_acquire (void);
-void filesys_release (void);
 void munmap_util (struct mapid_elem *);
 
 #endif /* userprog/syscall.h */
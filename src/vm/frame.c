@@ -4,38 +4,98 @@
 #include "userprog/pagedir.h"
 #include "userprog/syscall.h"
 #include "filesys/file.h"
+#include "devices/block.h"
 #include <stdio.h>
+#include <string.h>
 
-/* The frame table. */
-static struct hash frame_table;
+/* An entry in the frame table, describing one frame of the user pool. */
+struct frame
+  {
+    struct frame_elem *frame_elem;  /* Page in the frame, NULL if none. */
+    uint8_t age;                    /* Age counter for eviction. */
+  };
+
+/* The frame table, indexed by the number of the frame in the user pool. */
+static struct frame *frame_table;
+
+/* Number of entries in the frame table. */
+static size_t frame_cnt;
+
+/* Number of frames in the frame table holding a page. */
+static size_t used_frame_cnt;
+
+/* Index of the next frame to consider for eviction. */
+static size_t clock_hand;
 
 /* Lock to control concurrent accesses to the frame table. */
 static struct lock frame_table_lock;
 
-/* List to store all the allocated frames. */
-static struct list all_frames;
-
-/* Calculates the hash for a frame_elem. */
-static unsigned
-frame_hash (const struct hash_elem *e, void *aux UNUSED)
+/* How frames are chosen for eviction, set with -evict at boot. */
+enum evict_policy frame_evict_policy = EVICT_SECOND_CHANCE;
+
+/* Names of the eviction policies, for -evict. */
+static const char *evict_policy_names[] =
+  {
+    [EVICT_SECOND_CHANCE] = "second-chance",
+    [EVICT_AGING] = "aging",
+    [EVICT_WSCLOCK] = "wsclock",
+  };
+
+/* Under aging, the frames with the lowest age counters at the start of the
+   current eviction round, lowest first, and the index of the next one to
+   evict. */
+static struct frame *aged[SWAP_CLUSTER];
+static size_t aged_cnt;
+static size_t aged_next;
+
+/* Under WSClock, a frame that has not been accessed for more than this many
+   sweeps of the clock hand is outside the working set. */
+#define WSCLOCK_AGE 2
+
+/* The reclaim thread is woken when fewer than low_watermark user frames are
+   free, and then evicts frames until high_watermark are. Both are 0 if
+   there are too few frames to keep any spare. */
+static size_t low_watermark;
+static size_t high_watermark;
+
+/* Signalled when free frames drop below low_watermark. */
+static struct condition reclaim_cond;
+
+/* Broadcast when frames have finished being evicted or loaded. */
+static struct condition evicted_cond;
+
+/* Statistics. */
+static long long evict_cnt;     /* Number of frames evicted. */
+static long long scan_cnt;      /* Number of frames looked at to do so. */
+static long long reclaim_cnt;   /* Frames evicted by the reclaim thread. */
+
+/* Puts frame_elem in the frame table entry for its frame. */
+static void
+add_frame (struct frame_elem *frame_elem)
 {
-  void *frame = hash_entry (e, struct frame_elem, elem)->frame;
-  return hash_int ((int) frame);
+  ASSERT (lock_held_by_current_thread (&frame_table_lock));
+
+  struct frame *f = &frame_table[palloc_user_page_idx (frame_elem->frame)];
+  ASSERT (f->frame_elem == NULL);
+  f->frame_elem = frame_elem;
+  f->age = 0;
+  used_frame_cnt++;
 }
 
-/* Compares two frame_elem. */
-static bool
-frame_less (const struct hash_elem *a, 
-            const struct hash_elem *b, 
-            void *aux UNUSED)
+/* Removes frame_elem from the frame table entry for its frame. */
+static void
+remove_frame (struct frame_elem *frame_elem)
 {
-  void *frame_a = hash_entry (a, struct frame_elem, elem)->frame;
-  void *frame_b = hash_entry (b, struct frame_elem, elem)->frame;
-  return frame_a < frame_b;
+  ASSERT (lock_held_by_current_thread (&frame_table_lock));
+
+  struct frame *f = &frame_table[palloc_user_page_idx (frame_elem->frame)];
+  ASSERT (f->frame_elem == frame_elem);
+  f->frame_elem = NULL;
+  used_frame_cnt--;
 }
 
 /* Creates a frame_elem for a pointer to a frame and inserts it into the frame 
-   table and all_frames list. Returns the created frame. */
+   table. Returns the created frame. */
 static struct frame_elem *
 insert_frame (void *frame)
 {
@@ -47,67 +107,213 @@ insert_frame (void *frame)
 
   frame_elem->frame = frame;
   frame_elem->swapped = false;
+  frame_elem->pinned = true;
+  frame_elem->evicting = false;
+  frame_elem->loading = false;
+  frame_elem->swap_id = SWAP_NONE;
+  frame_elem->file = NULL;
   frame_elem->page_elem = NULL;
   list_init (&frame_elem->owners);
 
-  /* Adding the frame to the frame table and all_frames list. */
-  ASSERT (hash_insert (&frame_table, &frame_elem->elem) == NULL);
-  list_push_back (&all_frames, &frame_elem->all_elem); 
+  /* Adding the frame to the frame table. */
+  add_frame (frame_elem);
 
   return frame_elem;
 }
 
-/* Chooses a frame to evict using second chance algorithm. */
-static struct frame_elem *
-choose_frame_to_evict (void)
+/* Returns true if any of the threads using a frame has accessed it since the
+   last call, and clears their accessed bits. */
+static bool
+test_and_clear_accessed (struct frame_elem *frame_elem)
 {
-  ASSERT (lock_held_by_current_thread (&frame_table_lock));
+  bool is_accessed = false;
 
-  /* We check if the beginning of all frames has been accessed recently. If it 
-     has then we put it at the back of the list. Otherwise, we evict it. */
-  while (true)
+  for (struct list_elem *e = list_begin (&frame_elem->owners);
+       e != list_end (&frame_elem->owners);
+       e = list_next (e))
     {
-      struct frame_elem *frame_elem = 
-          list_entry (list_begin (&all_frames), struct frame_elem, all_elem);
-      bool is_accessed = false;
-
-      /* Iterate through the owners and check if any of them have accesses the
-         frame recently. */
-      for (struct list_elem *e = list_begin (&frame_elem->owners);
-           e != list_end (&frame_elem->owners);
-           e = list_next (e))
+      struct thread_list_elem *t = 
+          list_entry (e, struct thread_list_elem, elem);
+      ASSERT (t->t->magic == 0xcd6abf4b);
+      if (pagedir_test_and_clear_accessed (t->t->pagedir, t->vaddr))
+        is_accessed = true;
+    }
+  return is_accessed;
+}
+
+/* Returns true if any of the threads using a frame has written to it since
+   it was last brought in. */
+static bool
+is_dirty (struct frame_elem *frame_elem)
+{
+  for (struct list_elem *e = list_begin (&frame_elem->owners);
+       e != list_end (&frame_elem->owners);
+       e = list_next (e))
+    {
+      struct thread_list_elem *t = 
+          list_entry (e, struct thread_list_elem, elem);
+      if (pagedir_is_dirty (t->t->pagedir, t->vaddr))
+        return true;
+    }
+  return false;
+}
+
+/* Returns true if evicting a frame means writing its page out, rather than
+   dropping it because its file or swap slot already has the same
+   contents. */
+static bool
+needs_write (struct frame_elem *frame_elem)
+{
+  return (is_dirty (frame_elem)
+          || (frame_elem->file == NULL && frame_elem->swap_id == SWAP_NONE));
+}
+
+/* Moves the clock hand past the next frame holding a page that is not
+   pinned, and returns that frame's entry, or NULL if there is none. */
+static struct frame *
+advance_clock_hand (void)
+{
+  for (size_t i = 0; i < frame_cnt; i++)
+    {
+      struct frame *f = &frame_table[clock_hand];
+      clock_hand = (clock_hand + 1) % frame_cnt;
+      if (f->frame_elem != NULL && !f->frame_elem->pinned)
         {
-          struct thread_list_elem *t = 
-              list_entry (e, struct thread_list_elem, elem);
-          ASSERT (t->t->magic == 0xcd6abf4b);
-          if (pagedir_is_accessed (t->t->pagedir, t->vaddr))
-            is_accessed = true;
-          pagedir_set_accessed (t->t->pagedir, t->vaddr, false);
+          scan_cnt++;
+          return f;
         }
+    }
+  return NULL;
+}
+
+/* Chooses a frame to evict using the second chance algorithm: the first
+   frame under the clock hand that has not been accessed since the hand last
+   passed it. */
+static struct frame_elem *
+choose_second_chance (void)
+{
+  while (true)
+    {
+      struct frame *f = advance_clock_hand ();
+      if (f == NULL || !test_and_clear_accessed (f->frame_elem))
+        return f != NULL ? f->frame_elem : NULL;
+    }
+}
+
+/* Ages every frame for an eviction round, an approximation of least
+   recently used: shifts each frame's accessed bit into the top of its age
+   counter, and remembers the SWAP_CLUSTER frames with the lowest counters,
+   which have gone longest without being accessed, for choose_aging() to
+   hand out. The counters only age once per round, which is when their
+   order matters, so a round that evicts several frames keeps the history
+   of the rounds before it. */
+static void
+age_frames (void)
+{
+  aged_cnt = aged_next = 0;
+  for (size_t i = 0; i < frame_cnt; i++)
+    {
+      struct frame *f = &frame_table[(clock_hand + i) % frame_cnt];
+      if (f->frame_elem == NULL || f->frame_elem->pinned)
+        continue;
+      scan_cnt++;
+      f->age >>= 1;
+      if (test_and_clear_accessed (f->frame_elem))
+        f->age |= 0x80;
+
+      /* Insert the frame among the lowest seen so far, in order of age,
+         dropping the highest if there is no room. */
+      size_t j = aged_cnt < SWAP_CLUSTER ? aged_cnt++ : SWAP_CLUSTER;
+      for (; j > 0 && aged[j - 1]->age > f->age; j--)
+        if (j < SWAP_CLUSTER)
+          aged[j] = aged[j - 1];
+      if (j < SWAP_CLUSTER)
+        aged[j] = f;
+    }
+
+  /* Break ties between equally old frames differently next round. */
+  clock_hand = (clock_hand + 1) % frame_cnt;
+}
+
+/* Chooses a frame to evict by aging: the oldest of the frames picked by
+   the last call to age_frames() that has not been chosen yet. */
+static struct frame_elem *
+choose_aging (void)
+{
+  if (aged_next == aged_cnt)
+    return NULL;
+  return aged[aged_next++]->frame_elem;
+}
+
+/* Chooses a frame to evict using WSClock. The age of each frame the clock
+   hand passes counts the sweeps since it was last accessed, and the first
+   one that has left the working set and can be evicted without being
+   written is chosen. Old frames that would need writing are passed over,
+   in the hope that a clean one follows. If one sweep finds no clean old
+   frame, the oldest frame seen is chosen instead. */
+static struct frame_elem *
+choose_wsclock (void)
+{
+  struct frame *oldest = NULL;
 
-      if (!is_accessed)
-        return frame_elem;
+  for (size_t i = 0; i < used_frame_cnt; i++)
+    {
+      struct frame *f = advance_clock_hand ();
+      if (f == NULL)
+        return NULL;
+      if (test_and_clear_accessed (f->frame_elem))
+        {
+          f->age = 0;
+          continue;
+        }
 
-      /* Remove the frame from the front and move it to the back. */
-      list_remove (&frame_elem->all_elem);
-      list_push_back (&all_frames, &frame_elem->all_elem);
+      if (f->age < UINT8_MAX)
+        f->age++;
+      if (f->age > WSCLOCK_AGE && !needs_write (f->frame_elem))
+        return f->frame_elem;
+      if (oldest == NULL || f->age > oldest->age)
+        oldest = f;
     }
 
-  /* We should never reach here. */
-  NOT_REACHED ();
+  /* Every frame was accessed since the hand last passed it, so fall back to
+     second chance. */
+  if (oldest == NULL)
+    return choose_second_chance ();
+  return oldest->frame_elem;
 }
 
-/* Evicts a frame and puts its contents into the swap table. The frame to be
-   evicted is chosen using the second chance algorithm. */
-static void
-evict_frame (void)
+/* Chooses a frame to evict using the policy selected at boot. Returns NULL
+   if every frame is pinned. */
+static struct frame_elem *
+choose_frame_to_evict (void)
 {
   ASSERT (lock_held_by_current_thread (&frame_table_lock));
 
-  /* Find a frame to evict. */
-  struct frame_elem *to_evict = choose_frame_to_evict ();
-  //printf ("DEBUG Evicting %p which is %p\n", to_evict->frame, to_evict->page_elem);
+  struct frame_elem *frame_elem = NULL;
+  switch (frame_evict_policy)
+    {
+    case EVICT_SECOND_CHANCE:
+      frame_elem = choose_second_chance ();
+      break;
+    case EVICT_AGING:
+      frame_elem = choose_aging ();
+      break;
+    case EVICT_WSCLOCK:
+      frame_elem = choose_wsclock ();
+      break;
+    }
+
+  if (frame_elem != NULL)
+    evict_cnt++;
+  return frame_elem;
+}
 
+/* Takes a frame chosen for eviction out of use: unmaps it from the page
+   directories of all the threads that are using it and removes it from the
+   frame table. Its page is left for the caller to save. */
+static void
+unmap_frame (struct frame_elem *to_evict)
+{
   ASSERT (!to_evict->swapped);
   to_evict->swapped = true;
 
@@ -123,29 +329,213 @@ evict_frame (void)
       pagedir_clear_page (t->t->pagedir, t->vaddr);
     }
 
-  /* Swap the contents using the swap table or the file in case of mmap frames. 
-     We place this after clearing the page directories of all threads so that if
-     they tried to modify the frame then the changes get written to the swap 
-     table. */
-  if (to_evict->page_elem)
+  /* Remove the frame from the frame table. */
+  remove_frame (to_evict);
+}
+
+/* Evicts up to SWAP_CLUSTER frames, chosen using the eviction policy, and
+   returns how many. Clean pages that can be read back from their file or
+   swap slot are dropped. The rest are written back to their files, for mmap
+   frames, or to swap, where they are put in consecutive slots so that they
+   go in one transfer and can be read back the same way.
+
+   The writes are done without holding frame_table_lock, so that page faults
+   which find a free frame are not held up behind them. Until they finish
+   the frames being written are marked as evicting, and anyone who needs one
+   of them waits on evicted_cond. */
+static size_t
+evict_frames (void)
+{
+  ASSERT (lock_held_by_current_thread (&frame_table_lock));
+
+  struct frame_elem *to_write[SWAP_CLUSTER];
+  struct frame_elem *to_swap[SWAP_CLUSTER];
+  size_t write_cnt = 0;
+  size_t swap_cnt = 0;
+  size_t evicted;
+
+  if (frame_evict_policy == EVICT_AGING)
+    age_frames ();
+  for (evicted = 0; evicted < SWAP_CLUSTER; evicted++)
     {
-      /* TODO: check for dirty bit. */
-      struct page_elem *page_elem = to_evict->page_elem;
-      filesys_acquire ();
-      file_seek (page_elem->file, page_elem->offset);
-      ASSERT (file_write (page_elem->file, to_evict->frame, page_elem->bytes_read) == page_elem->bytes_read);
-      filesys_release ();
+      /* Find a frame to evict. Its dirty bits are read after it is
+         unmapped, which leaves them in the page tables, so that no write
+         can slip in between. */
+      struct frame_elem *to_evict = choose_frame_to_evict ();
+      if (to_evict == NULL)
+        break;
+      unmap_frame (to_evict);
+
+      /* A clean page that came from a file, which includes all read only
+         executable pages, or that is still in the swap slot it was read
+         from is dropped and read from there again when next needed. Dirty
+         mmap frames are written back to their files. Everything else goes
+         to swap. */
+      if (!needs_write (to_evict))
+        {
+          palloc_free_page (to_evict->frame);
+          to_evict->frame = NULL;
+          continue;
+        }
+
+      to_evict->evicting = true;
+      to_write[write_cnt++] = to_evict;
+      if (to_evict->page_elem == NULL)
+        {
+          /* The page no longer matches its file or swap slot, if it had
+             one. */
+          to_evict->file = NULL;
+          if (to_evict->swap_id != SWAP_NONE)
+            {
+              free_swap_elem (to_evict->swap_id);
+              to_evict->swap_id = SWAP_NONE;
+            }
+          to_swap[swap_cnt++] = to_evict;
+        }
     }
-  else
-    to_evict->swap_id = swap_kpage_in (to_evict->frame);
 
-  /* Remove the frame from the hash table and the all list. */
-  list_remove (&to_evict->all_elem);
-  ASSERT (hash_delete (&frame_table, &to_evict->elem));
+  if (write_cnt == 0)
+    return evicted;
+
+  swap_reserve_slots (to_swap, swap_cnt);
+  lock_release (&frame_table_lock);
+
+  for (size_t i = 0; i < write_cnt; i++)
+    {
+      struct page_elem *page_elem = to_write[i]->page_elem;
+      if (page_elem != NULL)
+        {
+          /* mmap allocated every sector of the file, so the write
+             cannot run out of disk space. */
+          enum io_purpose old = block_set_purpose (IO_MMAP_WRITEBACK);
+          off_t written = file_write_at (page_elem->file, to_write[i]->frame,
+                                         page_elem->bytes_read,
+                                         page_elem->offset);
+          block_set_purpose (old);
+          ASSERT (written == (off_t) page_elem->bytes_read);
+        }
+    }
+  swap_write_pages (to_swap, swap_cnt);
+
+  lock_acquire (&frame_table_lock);
+
+  /* Free the physical memory of the frames and mark that in the
+     frame_elems. */
+  for (size_t i = 0; i < write_cnt; i++)
+    {
+      palloc_free_page (to_write[i]->frame);
+      to_write[i]->frame = NULL;
+      to_write[i]->evicting = false;
+    }
+  cond_broadcast (&evicted_cond, &frame_table_lock);
+  return evicted;
+}
+
+/* Waits until frame_elem is not being evicted, or read back in from its
+   file. */
+static void
+wait_for_eviction (struct frame_elem *frame_elem)
+{
+  ASSERT (lock_held_by_current_thread (&frame_table_lock));
+
+  while (frame_elem->evicting || frame_elem->loading)
+    cond_wait (&evicted_cond, &frame_table_lock);
+}
+
+/* Allocates a user page, evicting frames to make room if there is none
+   free. Wakes the reclaim thread if free frames have run low. May let go of
+   frame_table_lock while evicting. */
+static void *
+get_user_page (enum palloc_flags flags)
+{
+  ASSERT (lock_held_by_current_thread (&frame_table_lock));
+
+  void *page;
+  while ((page = palloc_get_page (PAL_USER | flags)) == NULL)
+    if (evict_frames () == 0)
+      {
+        /* Every frame is pinned by a thread that is still loading it. */
+        lock_release (&frame_table_lock);
+        thread_yield ();
+        lock_acquire (&frame_table_lock);
+      }
+
+  if (palloc_user_free_cnt () < low_watermark)
+    cond_signal (&reclaim_cond, &frame_table_lock);
+  return page;
+}
+
+/* Evicts frames in the background. Whenever free user frames drop below
+   low_watermark it evicts until there are high_watermark free, so that page
+   faults seldom have to evict frames, and wait for their pages to be
+   written, themselves. Its writes keep the default, interactive class
+   rather than a background one: a process that faults on a page being
+   reclaimed waits for them to finish. */
+static void
+reclaim_thread (void *aux UNUSED)
+{
+  lock_acquire (&frame_table_lock);
+  while (true)
+    {
+      cond_wait (&reclaim_cond, &frame_table_lock);
+      while (palloc_user_free_cnt () < high_watermark)
+        {
+          size_t evicted = evict_frames ();
+          if (evicted == 0)
+            break;
+          reclaim_cnt += evicted;
+        }
+    }
+}
+
+/* Makes page, which holds the contents of frame_elem, its frame. Adds it to
+   the frame table and the page directories of all its owners. */
+static void
+install_frame (struct frame_elem *frame_elem, void *page)
+{
+  ASSERT (lock_held_by_current_thread (&frame_table_lock));
+
+  /* Mark that the frame is no longer swapped and update the frame. */
+  frame_elem->swapped = false;
+  frame_elem->frame = page;
+
+  /* Insert the frame into the frame table. */
+  add_frame (frame_elem);
+
+  /* Add the frame to all the owning thread's page directories. */
+  for (struct list_elem *e = list_begin (&frame_elem->owners);
+       e != list_end (&frame_elem->owners);
+       e = list_next (e))
+    {
+        struct thread_list_elem *t = 
+            list_entry (e, struct thread_list_elem, elem);
+        ASSERT (t->t->magic == 0xcd6abf4b);
+        ASSERT (pagedir_set_page (t->t->pagedir, t->vaddr, page, frame_elem->writable));
+    }
+}
+
+/* Selects the eviction policy with the given name. Returns false if there
+   is no such policy. */
+bool
+frame_set_evict_policy (const char *name)
+{
+  for (size_t i = 0; i < sizeof evict_policy_names / sizeof *evict_policy_names;
+       i++)
+    if (name != NULL && !strcmp (name, evict_policy_names[i]))
+      {
+        frame_evict_policy = i;
+        return true;
+      }
+  return false;
+}
 
-  /* Free the physical memory of the frame and mark that in the frame_elem. */
-  palloc_free_page (to_evict->frame);
-  to_evict->frame = NULL;
+/* Prints eviction statistics. */
+void
+frame_print_stats (void)
+{
+  printf ("Frames: %lld evicted by %s, %lld scanned, %lld by reclaim thread\n",
+          evict_cnt, evict_policy_names[frame_evict_policy], scan_cnt,
+          reclaim_cnt);
 }
 
 /* Initializes the frame table and its lock. */
@@ -153,27 +543,52 @@ void
 frame_table_init (void)
 {
   lock_init (&frame_table_lock);
-  hash_init (&frame_table, frame_hash, frame_less, NULL);
-  list_init (&all_frames);
+  frame_cnt = palloc_user_page_cnt ();
+  frame_table = calloc (frame_cnt, sizeof *frame_table);
+  ASSERT (frame_table != NULL);
+  clock_hand = 0;
+
+  cond_init (&reclaim_cond);
+  cond_init (&evicted_cond);
+  low_watermark = frame_cnt / 32;
+  high_watermark = frame_cnt / 16;
+  if (low_watermark > 0)
+    thread_create ("reclaim", PRI_DEFAULT, reclaim_thread, NULL);
+}
+
+/* Pins frame_elem so that it cannot be evicted, waiting for it if it is
+   being evicted already. Returns false, without pinning it, if it is not in
+   memory. */
+bool
+frame_pin (struct frame_elem *frame_elem)
+{
+  lock_acquire (&frame_table_lock);
+  wait_for_eviction (frame_elem);
+  bool resident = !frame_elem->swapped;
+  if (resident)
+    frame_elem->pinned = true;
+  lock_release (&frame_table_lock);
+  return resident;
+}
+
+/* Lets frame_elem, which frame_table_get_user_page() returns pinned so that
+   it is not evicted while it is being loaded, be evicted. */
+void
+frame_unpin (struct frame_elem *frame_elem)
+{
+  lock_acquire (&frame_table_lock);
+  ASSERT (frame_elem->pinned);
+  frame_elem->pinned = false;
+  lock_release (&frame_table_lock);
 }
 
 /* Gets a user page and puts it in the frame table. Returns the frame_elem that 
-   was created. */
+   was created, which is pinned until the caller calls frame_unpin(). */
 struct frame_elem *
 frame_table_get_user_page (enum palloc_flags flags, bool writable)
 {
-  //lock_acquire (&frame_table_lock);
-  void *page = palloc_get_page (PAL_USER | flags);
-  
   lock_acquire (&frame_table_lock);
-  if (page == NULL)
-    {
-      /* TODO: evict frame returns the frame elem so you do not have to palloc again. */
-      evict_frame ();
-      page = palloc_get_page (PAL_USER | flags);
-      ASSERT (page != NULL);
-    }
-
+  void *page = get_user_page (flags);
   struct frame_elem *frame_elem = insert_frame (page);
   lock_release (&frame_table_lock);
 
@@ -195,52 +610,51 @@ swap_in_frame (struct frame_elem *frame_elem)
 
   /* We need this check because multiple threads can call this function at the 
      same time but we want to make sure that we do not palloc a frame twice. */
+  wait_for_eviction (frame_elem);
   if (frame_elem->frame != NULL)
     goto done;
 
-  void *page = palloc_get_page (PAL_USER | PAL_ZERO);
-
-  /* Evict a frame if a new frame could not be obtained. */
-  if (page == NULL)
+  /* Getting a page may mean evicting frames, which lets go of the lock while
+     they are written, so someone else may have brought the page in. */
+  void *page = get_user_page (PAL_ZERO);
+  if (frame_elem->frame != NULL)
     {
-      evict_frame ();
-      page = palloc_get_page (PAL_USER | PAL_ZERO);
-      ASSERT (page != NULL);
+      palloc_free_page (page);
+      goto done;
     }
 
   /* Bring in the page from the swap table or the file system. Note that this 
      must be done before adding the frame to the threads' page directories as 
      they may see incorrect data otherwise. */
-  if (frame_elem->page_elem)
+  if (frame_elem->file != NULL)
     {
-      ASSERT (list_size (&frame_elem->owners) == 1);
-      struct page_elem *page_elem = frame_elem->page_elem;
-      filesys_acquire ();
-      file_seek (page_elem->file, page_elem->offset);
-      file_read (page_elem->file, page, page_elem->bytes_read);
-      filesys_release ();
+      /* Read the page without holding frame_table_lock, as evict_frames()
+         writes, so that other faults and the reclaim thread are not held
+         up behind the file system. Anyone else who wants the page waits
+         for it to be loaded. */
+      frame_elem->loading = true;
+      lock_release (&frame_table_lock);
+      file_read_at (frame_elem->file, page, frame_elem->file_bytes,
+                    frame_elem->file_ofs);
+      lock_acquire (&frame_table_lock);
+      frame_elem->loading = false;
+      cond_broadcast (&evicted_cond, &frame_table_lock);
     }
   else
-    swap_kpage_out (frame_elem->swap_id, page);
-
-  /* Mark that the frame is no longer swapped and update the frame. */
-  frame_elem->swapped = false;
-  frame_elem->frame = page;
-
-  /* Insert the frame to the hash table and all list. */
-  list_push_back (&all_frames, &frame_elem->all_elem);
-  ASSERT (hash_insert (&frame_table, &frame_elem->elem) == NULL);
-
-  /* Add the frame to all the owning thread's page directories. */
-  for (struct list_elem *e = list_begin (&frame_elem->owners);
-       e != list_end (&frame_elem->owners);
-       e = list_next (e))
     {
-        struct thread_list_elem *t = 
-            list_entry (e, struct thread_list_elem, elem);
-        ASSERT (t->t->magic == 0xcd6abf4b);
-        ASSERT (pagedir_set_page (t->t->pagedir, t->vaddr, page, frame_elem->writable));
+      ASSERT (frame_elem->swap_id != SWAP_NONE);
+
+      /* Also bring in whichever of the following swap slots hold pages of
+         this thread, which are likely to be wanted next, while the disk is
+         there. */
+      struct swap_ahead ahead[SWAP_CLUSTER - 1];
+      size_t ahead_cnt = swap_kpage_out (frame_elem->swap_id, page,
+                                         ahead, SWAP_CLUSTER - 1);
+      for (size_t i = 0; i < ahead_cnt; i++)
+        install_frame (ahead[i].frame_elem, ahead[i].kpage);
     }
+
+  install_frame (frame_elem, page);
 done:
   if (locked)
     lock_release (&frame_table_lock);
@@ -254,11 +668,7 @@ add_owner (struct frame_elem *frame_elem, void *vaddr)
   lock_acquire (&frame_table_lock);
   struct thread_list_elem *t = malloc (sizeof (struct thread_list_elem));
   ASSERT (t != NULL);
-  if (frame_elem->frame == NULL)
-    {
-      //ASSERT (frame_elem->swapped);
-      swap_in_frame (frame_elem);
-    }
+  swap_in_frame (frame_elem);
 
   //lock_acquire (&frame_table_lock);
   t->t = thread_current ();
@@ -305,6 +715,7 @@ free_frame_elem (struct frame_elem *frame_elem)
 {
   lock_acquire (&frame_table_lock);
   //ASSERT (*((uint8_t *) frame_elem) != 0xcc);
+  wait_for_eviction (frame_elem);
 
   /* Free the list of owners of the thread. */
   ASSERT (list_size (&frame_elem->owners) == 1);
@@ -317,23 +728,19 @@ free_frame_elem (struct frame_elem *frame_elem)
       free (t);
     } 
 
-  /* Remove from frame table and all frames if the frame was not currently 
-     swapped. */
+  /* Remove from the frame table if the frame was not currently swapped. */
   if (!frame_elem->swapped)
     {
       ASSERT (frame_elem->frame != NULL);
-      //lock_acquire (&frame_table_lock);
-      ASSERT (hash_delete (&frame_table, &frame_elem->elem));
-      list_remove (&frame_elem->all_elem);
-      //lock_release (&frame_table_lock);
+      remove_frame (frame_elem);
     }
 
   //printf ("DEBUG Freeing %p which is %p for %i\n", frame_elem->frame, frame_elem->page_elem, thread_tid ());
 
   /* Freeing the swap space or the frame pointer. */
-  if (frame_elem->swapped)
+  if (frame_elem->swap_id != SWAP_NONE)
     free_swap_elem (frame_elem->swap_id);
-  else
+  if (!frame_elem->swapped)
     palloc_free_page (frame_elem->frame);
 
   free (frame_elem);
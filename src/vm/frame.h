@@ -5,6 +5,7 @@
 #include "lib/kernel/hash.h"
 #include "lib/kernel/list.h"
 #include "threads/palloc.h"
+#include "filesys/off_t.h"
 #include "vm/page.h"
 
 /* A struct to create a list of threads who have a frame in their page \
@@ -16,21 +17,40 @@ struct thread_list_elem
     struct list_elem elem;      /* To create a list. */
   };
 
-/* Stores an entry in the frame table. */
+/* Stores a page of user memory, which the frame table entry for its frame
+   points to while it is in memory. */
 struct frame_elem
   {
     void *frame;                 /* Pointer to frame in memory. */
-    struct page_elem *page_elem; /* Pointer to page_elem for mmap frames. */
     bool swapped;                /* If the frame is currently swapped. */
-    size_t swap_id;              /* The swap id if it is swapped. */
-    struct list owners;          /* The threads which own the frame. */
     bool writable;               /* If the frame is writable. */
-    struct hash_elem elem;       /* To add this in a hash table. */
-    struct list_elem all_elem;   /* For creating list of all frames. */
+    bool pinned;                 /* If the frame may not be evicted. */
+    bool evicting;               /* If the page is being written out. */
+    bool loading;                /* If the page is being read in. */
+    size_t swap_id;              /* Swap slot with the page, or SWAP_NONE. */
+    struct page_elem *page_elem; /* Pointer to page_elem for mmap frames. */
+    struct file *file;           /* File to reload a clean page from. */
+    off_t file_ofs;              /* Offset of the page in file. */
+    size_t file_bytes;           /* Bytes of the page read from file. */
+    struct list owners;          /* The threads which own the frame. */
   };
 
+/* Ways of choosing a frame to evict. */
+enum evict_policy
+  {
+    EVICT_SECOND_CHANCE,        /* Clock with a single accessed bit. */
+    EVICT_AGING,                /* Aging approximation of LRU. */
+    EVICT_WSCLOCK               /* Working set clock. */
+  };
+
+extern enum evict_policy frame_evict_policy;
+
 void frame_table_init (void);
+bool frame_set_evict_policy (const char *);
+void frame_print_stats (void);
 struct frame_elem *frame_table_get_user_page (enum palloc_flags, bool writable);
+bool frame_pin (struct frame_elem *frame_elem);
+void frame_unpin (struct frame_elem *frame_elem);
 void swap_in_frame (struct frame_elem *frame_elem);
 void add_owner (struct frame_elem *frame_elem, void *vaddr);
 void remove_owner (struct frame_elem *frame_elem);
@@ -136,6 +136,7 @@ allocate_stack_page (void *fault_addr)
 
   page->frame_elem = frame_table_get_user_page (PAL_ZERO, true);
   add_owner (page->frame_elem, rnd_addr);
+  frame_unpin (page->frame_elem);
 }
 
 /* Takes a hash_elem and frees the resources associated with the corresponding
@@ -206,6 +207,12 @@ allocate_frame (void *fault_addr)
       /* Need to allocate a new frame and copy contents from file. */
       page_elem->frame_elem =
           frame_table_get_user_page (PAL_ZERO, page_elem->writable);
+
+      /* Until it is written to, the page can be read from the file again
+         instead of being swapped out. */
+      page_elem->frame_elem->file = page_elem->file;
+      page_elem->frame_elem->file_ofs = page_elem->offset;
+      page_elem->frame_elem->file_bytes = page_elem->bytes_read;
       add_owner (page_elem->frame_elem, page_elem->vaddr);
 
       /* Mark in frame if this is mmap file. */
@@ -216,14 +223,13 @@ allocate_frame (void *fault_addr)
         }
 
       /* Read the contents of the file into the frame. */
-      filesys_acquire ();
-      file_seek (page_elem->file, page_elem->offset);
-      int bytes_read = file_read (page_elem->file, page_elem->frame_elem->frame,
-                                  page_elem->bytes_read);
-      filesys_release ();
+      int bytes_read = file_read_at (page_elem->file,
+                                     page_elem->frame_elem->frame,
+                                     page_elem->bytes_read, page_elem->offset);
 
       /* Check that the read was fine. */
       if (bytes_read != (int) page_elem->bytes_read)
         exit_util (KILLED);
+      frame_unpin (page_elem->frame_elem);
     }
 }
@@ -98,7 +98,8 @@ get_frame_for_rox (struct page_elem *page_elem)
 
   /* Check if a frame already exists for the rox. */
   struct frame_elem *frame_elem = get_frame_if_exists (page_elem);
-  if (frame_elem == NULL)
+  bool loaded = frame_elem == NULL;
+  if (loaded)
   {
 
     /* Create a copy for file so that we are unaffacted if the caller code decides
@@ -117,18 +118,21 @@ get_frame_for_rox (struct page_elem *page_elem)
     share_elem->bytes_read = page_elem->bytes_read;
     share_elem->frame_elem = frame_table_get_user_page (PAL_ZERO, false);
     frame_elem = share_elem->frame_elem;
+    frame_elem->file = file_copy;
+    frame_elem->file_ofs = file_tell (file_copy);
+    frame_elem->file_bytes = page_elem->bytes_read;
 
     /* Insert the share_elem into the hash table. */
     hash_insert (&share_table, &share_elem->elem);
 
     /* Load the contennts of the file into the frame. */
-    filesys_acquire ();
-    file_read (file_copy, frame_elem->frame, page_elem->bytes_read);
-    file_seek (file_copy, file_tell (file));
-    filesys_release ();
+    file_read_at (file_copy, frame_elem->frame, page_elem->bytes_read,
+                  file_tell (file_copy));
   }
 
   add_owner (frame_elem, page_elem->vaddr);
+  if (loaded)
+    frame_unpin (frame_elem);
   lock_release (&share_table_lock);
   return frame_elem;
 }
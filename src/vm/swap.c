@@ -1,6 +1,7 @@
 #include "swap.h"
 #include "vm/frame.h"
 #include <lib/kernel/bitmap.h>
+#include <lib/kernel/hash.h>
 #include <threads/vaddr.h>
 #include <threads/malloc.h>
 #include <threads/palloc.h>
@@ -14,142 +15,275 @@ static struct block *swap_block;
 /* Tracking used slots */
 static struct bitmap *used_slots;
 
+/* Slot at which to start looking for free slots.  Allocating
+   onward from the last allocation, rather than from 0 each time,
+   keeps pages evicted together in consecutive slots. */
+static size_t next_slot;
+
 /* Global lock for the swap table. */
 static struct lock swap_lock;
 
-/* The global swap table. */
-static struct hash swap_table;
-
-/* Calculates the hash for a swap_elem. */
-static unsigned
-hash_swap_elem (const struct hash_elem *e, void *aux UNUSED)
-{
-  size_t index = hash_entry (e, struct swap_slot, elem)->index;
-  return hash_int ((int) index);
-}
-
-/* Compares two swap_elem. */
-static bool
-hash_swap_less (const struct hash_elem *a,
-               const struct hash_elem *b,
-               void *aux UNUSED)
-{
-    size_t index1 = hash_entry (a, struct swap_slot, elem)->index;
-    size_t index2 = hash_entry (b, struct swap_slot, elem)->index;
-    return index1 < index2;
-}
+/* The global swap table, indexed by slot number. used_slots mirrors
+   whether each entry's refcnt is nonzero, so that runs of free slots
+   can be found a word at a time. */
+static struct swap_slot *swap_table;
 
-/* Initialises the swap table lock, hash table and all other members. */
+/* Initialises the swap table lock, swap table and all other members. */
 void
 swap_table_init (void)
 {
     lock_init (&swap_lock);
-    hash_init (&swap_table, hash_swap_elem, hash_swap_less, NULL);
     swap_block = block_get_role (BLOCK_SWAP);
-    used_slots = bitmap_create
-                    (block_size (swap_block) / SECTORS_PER_PAGE);
+    size_t slot_cnt = block_size (swap_block) / SECTORS_PER_PAGE;
+    used_slots = bitmap_create (slot_cnt);
     ASSERT (used_slots != NULL);
+    swap_table = calloc (slot_cnt, sizeof *swap_table);
+    ASSERT (swap_table != NULL || slot_cnt == 0);
+    next_slot = 0;
 }
 
-/* Writes the kpage to the swap slot indexed by the given index. */
+/* Returns the swap table entry for the slot of the given index, or
+   NULL if the slot is free. */
+static struct swap_slot *
+lookup_slot (size_t index)
+{
+  ASSERT (lock_held_by_current_thread (&swap_lock));
+
+  struct swap_slot *slot = &swap_table[index];
+  return slot->refcnt > 0 ? slot : NULL;
+}
+
+/* Drops a reference to the slot of the given index, freeing it once
+   there are none left. */
 static void
-write_to_swap (size_t index, void *kpage)
+release_slot (size_t index)
+{
+  ASSERT (lock_held_by_current_thread (&swap_lock));
+  ASSERT (bitmap_test (used_slots, index));
+
+  struct swap_slot *slot = &swap_table[index];
+  ASSERT (slot->refcnt > 0);
+  if (--slot->refcnt == 0)
+    {
+      slot->owner = NULL;
+      bitmap_set (used_slots, index, false);
+    }
+}
+
+/* Frees the slots kept by the swap cache for pages that are in memory,
+   which are only an optimisation, to make room when swap is full.
+   Returns the number of slots freed. */
+static size_t
+reclaim_cached_slots (void)
 {
-  ASSERT (kpage != NULL);
-  for (int i = 0; i < SECTORS_PER_PAGE; i++)
+  ASSERT (lock_held_by_current_thread (&swap_lock));
+
+  size_t freed = 0;
+  for (size_t index = 0; index < bitmap_size (used_slots); index++)
     {
-      block_sector_t sector = (block_sector_t) (index * SECTORS_PER_PAGE + i);
-      block_write (swap_block, sector, kpage + (i * BLOCK_SECTOR_SIZE));
+      struct swap_slot *slot = lookup_slot (index);
+      if (slot != NULL && !slot->owner->swapped)
+        {
+          slot->owner->swap_id = SWAP_NONE;
+          release_slot (index);
+          freed++;
+        }
     }
+  return freed;
 }
 
-/* Reads the the swap slot indexed by the given slot_index into the
-   given kernel page. */
+/* Allocates up to cnt consecutive free slots, halving the number
+   until a run that long is found, and reclaiming the swap cache's
+   slots if none is free. Stores the index of the first in *first and
+   returns the number allocated, which is at least 1. */
+static size_t
+allocate_slots (size_t cnt, size_t *first)
+{
+  ASSERT (lock_held_by_current_thread (&swap_lock));
+
+  do
+    {
+      for (size_t n = cnt; n > 0; n /= 2)
+        {
+          size_t idx = bitmap_scan_and_flip (used_slots, next_slot, n, false);
+          if (idx == BITMAP_ERROR)
+            idx = bitmap_scan_and_flip (used_slots, 0, n, false);
+          if (idx != BITMAP_ERROR)
+            {
+              *first = idx;
+              next_slot = (idx + n) % bitmap_size (used_slots);
+              return n;
+            }
+        }
+    }
+  while (reclaim_cached_slots () > 0);
+  PANIC ("out of swap space");
+}
+
+/* Completion function for the requests of transfer_pages(). */
 static void
-read_into_kpage (size_t slot_index, void *kpage)
+wake_waiter (struct block_request *r)
 {
-  ASSERT (kpage != NULL);
-  for (int i = 0; i < SECTORS_PER_PAGE; i++)
-  {
-    block_sector_t sector = (block_sector_t) (slot_index * SECTORS_PER_PAGE + i);
-    block_read(swap_block, sector, kpage + (i * BLOCK_SECTOR_SIZE));
-  }
+  sema_up (r->aux);
 }
 
-/* Move the page stored in the swap slot of the given index into the given
-   kernel page. Updates the swap table to reflect this change. */
-void
-swap_kpage_out (size_t index, void *kpage)
+/* Writes the cnt pages in kpages to the cnt slots starting at the
+   given index, or reads them from there if write is false. The
+   pages need not be adjacent in memory: one request is queued for
+   each and the block layer merges them into a single transfer. The
+   requests live on the heap, as a cluster of them is too large for
+   the kernel stacks of the eviction paths. */
+static void
+transfer_pages (size_t index, void **kpages, size_t cnt, bool write)
 {
-  lock_acquire (&swap_lock);
-  /* set the bit at index of used slots bitmaps to false. */
-  /* Frees that slot for new pages. */
-  bitmap_set (used_slots, index, false);
-  //printf("Slots left: %d\n", bitmap_count(used_slots, 0, bitmap_size(used_slots), false));
+  struct block_request *requests;
+  struct semaphore done;
 
-  /* Assert the swap tables bit at the index is set to false */
-  ASSERT (!bitmap_test (used_slots, index));
+  ASSERT (cnt <= SWAP_CLUSTER);
+  requests = malloc (SWAP_CLUSTER * sizeof *requests);
+  ASSERT (requests != NULL);
 
-  /* Remove corresponding swap entry from swap table. */
-  struct swap_slot del;
-  del.index = index;
-  ASSERT (hash_delete (&swap_table, &del.elem));
+  sema_init (&done, 0);
+  for (size_t i = 0; i < cnt; i++)
+    {
+      struct block_request *r = &requests[i];
+      ASSERT (kpages[i] != NULL);
+      r->sector = (block_sector_t) ((index + i) * SECTORS_PER_PAGE);
+      r->cnt = SECTORS_PER_PAGE;
+      r->buffer = kpages[i];
+      r->write = write;
+      r->purpose = write ? IO_SWAP_OUT : IO_SWAP_IN;
+      r->class = thread_current ()->io_class;
+      r->done = wake_waiter;
+      r->aux = &done;
+      block_submit (swap_block, r);
+    }
+  for (size_t i = 0; i < cnt; i++)
+    sema_down (&done);
+  free (requests);
+}
 
-  /* Reading the contents at the index into the page */
-  read_into_kpage (index, kpage);
-  lock_release (&swap_lock);
+/* Returns true if the running thread owns the given frame. */
+static bool
+owned_by_current_thread (struct frame_elem *frame_elem)
+{
+  for (struct list_elem *e = list_begin (&frame_elem->owners);
+       e != list_end (&frame_elem->owners);
+       e = list_next (e))
+    if (list_entry (e, struct thread_list_elem, elem)->t == thread_current ())
+      return true;
+  return false;
 }
 
-/* Creates a new entry in the swap table with the given thread and user page.
-   Copies the given kernel page into a free swap slot.
-   Returns the index of that swap slot. */
+/* Reads the page stored in the swap slot of the given index into the given
+   kernel page. The slot is not freed: it stays with the page as the swap
+   cache, so that the page can be evicted again without being written if it
+   is not modified in the meantime.
+
+   Also reads ahead up to max of the pages in the slots that follow, as long
+   as they belong to the running thread, are not in memory, and free user
+   pages are available to hold them, all in one transfer. Each page read ahead
+   and its frame_elem are stored in ahead. Returns the number of pages read
+   ahead. */
 size_t
-swap_kpage_in (void *kpage)
+swap_kpage_out (size_t index, void *kpage, struct swap_ahead *ahead,
+                size_t max)
 {
-  struct swap_slot *elem = malloc (sizeof (struct swap_slot));
-  ASSERT (elem);
+  void *kpages[SWAP_CLUSTER];
+  size_t cnt = 0;
+
+  ASSERT (max < SWAP_CLUSTER);
 
   lock_acquire (&swap_lock);
+  ASSERT (bitmap_test (used_slots, index));
+  kpages[0] = kpage;
+  while (cnt < max)
+    {
+      size_t next = index + cnt + 1;
+      if (next >= bitmap_size (used_slots))
+        break;
+      struct swap_slot *slot = lookup_slot (next);
+      if (slot == NULL || slot->owner->frame != NULL
+          || !owned_by_current_thread (slot->owner))
+        break;
+      void *page = palloc_get_page (PAL_USER);
+      if (page == NULL)
+        break;
 
-  /* find the first unused slot by searching for first bit set to false */
-  size_t idx = bitmap_scan_and_flip (used_slots, 0, 1, false);
-  //size_t count = bitmap_count(used_slots, 0, bitmap_size(used_slots), false);
-  //printf("Slots left: %d\n", count);
-  //if (count <= 905) {
-  //  printf("BREAK HERE\n");
-  //}
+      ahead[cnt].frame_elem = slot->owner;
+      ahead[cnt].kpage = page;
+      kpages[++cnt] = page;
+    }
+  lock_release (&swap_lock);
 
-  ASSERT (idx != BITMAP_ERROR);
+  transfer_pages (index, kpages, cnt + 1, false);
 
-  elem->index = idx;
+  for (size_t i = 0; i <= cnt; i++)
+    if (hash_bytes (kpages[i], PGSIZE) != swap_table[index + i].checksum)
+      PANIC ("swap slot %zu read back corrupted", index + i);
+  return cnt;
+}
 
-  struct hash_elem *e = hash_insert (&swap_table, &elem->elem);
-  ASSERT (!e);
+/* Allocates swap slots for the pages of the cnt frames in frames,
+   recording each one's slot in its swap_id. Consecutive frames get
+   consecutive slots where possible, so that swap_write_pages() can
+   write their pages in as few transfers as possible. The caller must
+   hold the frame table lock, and keep the pages unchanged until they
+   have been written. */
+void
+swap_reserve_slots (struct frame_elem **frames, size_t cnt)
+{
+  lock_acquire (&swap_lock);
+  while (cnt > 0)
+    {
+      size_t first;
+      size_t n = allocate_slots (cnt < SWAP_CLUSTER ? cnt : SWAP_CLUSTER,
+                                 &first);
+      for (size_t i = 0; i < n; i++)
+        {
+          struct swap_slot *slot = &swap_table[first + i];
+          ASSERT (slot->refcnt == 0);
+          slot->owner = frames[i];
+          slot->refcnt = 1;
+          slot->checksum = hash_bytes (frames[i]->frame, PGSIZE);
 
-  write_to_swap (elem->index, kpage);
+          frames[i]->swap_id = first + i;
+        }
+      frames += n;
+      cnt -= n;
+    }
   lock_release (&swap_lock);
-  return idx;
 }
 
+/* Writes the pages of the cnt frames in frames to the swap slots
+   reserved for them by swap_reserve_slots(), a run of consecutive
+   slots at a time. */
 void
-free_swap_elem (size_t index)
+swap_write_pages (struct frame_elem **frames, size_t cnt)
 {
-  lock_acquire (&swap_lock);
-
-  ASSERT (bitmap_test (used_slots, index));
-  bitmap_set (used_slots, index, false);
-  /* Assert the swap tables bit at the index is set to false */
-  ASSERT (!bitmap_test (used_slots, index));
+  while (cnt > 0)
+    {
+      void *kpages[SWAP_CLUSTER];
+      size_t n = 0;
 
-  struct swap_slot elem;
-  elem.index = index;
+      do
+        {
+          kpages[n] = frames[n]->frame;
+          n++;
+        }
+      while (n < cnt && n < SWAP_CLUSTER
+             && frames[n]->swap_id == frames[0]->swap_id + n);
 
-  struct hash_elem *e = hash_delete (&swap_table, &elem.elem);
-  ASSERT (e != NULL);
+      transfer_pages (frames[0]->swap_id, kpages, n, true);
+      frames += n;
+      cnt -= n;
+    }
+}
 
+void
+free_swap_elem (size_t index)
+{
+  lock_acquire (&swap_lock);
+  release_slot (index);
   lock_release (&swap_lock);
-
-  /* Freeing all resources used by the swap_elem */
-  struct swap_slot *elem_free = hash_entry (e, struct swap_slot, elem);
-  free(elem_free);
 }
@@ -2,18 +2,36 @@
 #define SWAP_H
 
 #include <devices/block.h>
-#include <lib/kernel/hash.h>
 #include <threads/thread.h>
 
+struct frame_elem;
+
+/* swap_id of a frame that is not in swap. */
+#define SWAP_NONE ((size_t) -1)
+
+/* Most pages written to swap, or read from it, in one transfer. */
+#define SWAP_CLUSTER 8
+
+/* State of a swap slot. The swap table holds one for every slot, indexed
+   by slot number. */
 struct swap_slot
   {
-    size_t index;                   /* Index into the swap table. */
-    struct hash_elem elem;          /* To put in the swap table. */
+    struct frame_elem *owner;       /* Frame whose page is in the slot. */
+    unsigned refcnt;                /* References to the slot, 0 if free. */
+    unsigned checksum;              /* Checksum of the page written. */
+  };
+
+/* A page read ahead from swap. */
+struct swap_ahead
+  {
+    struct frame_elem *frame_elem;  /* Frame the page belongs to. */
+    void *kpage;                    /* Page it was read into. */
   };
 
 void swap_table_init (void);
-void swap_kpage_out (size_t, void *);
-size_t swap_kpage_in (void *);
+size_t swap_kpage_out (size_t, void *, struct swap_ahead *, size_t max);
+void swap_reserve_slots (struct frame_elem **, size_t cnt);
+void swap_write_pages (struct frame_elem **, size_t cnt);
 void free_swap_elem(size_t);
 
 #endif /* vm/swap.h */